@@ -1,7 +1,13 @@
 #include "hashapi.h"
+#include "mine-cpu.h"
+#include "mine-net.h"
 #include "ocl-device.h"
 #include "ocl-program.h"
 #include "ocl-sha1.h"
+#include "ocl-tune.h"
+#include <algorithm>
+#include <thread>
+#include <time.h>
 
 namespace gitmine {
 
@@ -79,53 +85,228 @@ int testOpenCL(OpenCLdev& dev, const CommitMessage& commit) {
   return testOpenCL2(dev, p);
 }
 
-int findHash(OpenCLdev& dev, const CommitMessage& commit,
-             long long atime_hint, long long ctime_hint) {
-  FILE* f = fopen("/usr/local/google/home/dsp/restore/git-mine/sha1.cl", "r");
-  if (!f) {
-    fprintf(stderr, "Unable to read OpenCL source: %d %s\n", errno,
-            strerror(errno));
-    return 1;
-  }
-  size_t codeLen = 16*1024*1024;
-  char* codeBuf = (char*)malloc(codeLen);
-  if (!codeBuf) {
-    fprintf(stderr, "malloc(%zu) failed\n", codeLen);
-    return 1;
-  }
-  size_t rresult = fread(codeBuf,1, codeLen, f);
-  if (rresult >= codeLen || rresult == 0) {
-    fprintf(stderr, "fread OpenCL source failed\n");
-    return 1;
-  }
-  fclose(f);
-  codeBuf[rresult] = 0;
-  const char* mainFuncName = "main";
-  const char* compilerOptions = "";
+// sha1_cl is the source of sha1.cl, embedded by the Makefile.
+static const char sha1_cl[] =
+#include ".o/sha1.cl.h"
+;
 
+// getVendorOptions outputs the options for dev's compiler to build sha1.cl.
+static std::string getVendorOptions(OpenCLdev& dev) {
   // This is controlled different on AMD: see
   // __attribute__((reqd_work_group_size(64,1,1))) such as in
   // https://community.amd.com/thread/158594
   if (dev.info.vendor.find("NVIDIA") != std::string::npos) {
-    compilerOptions = "-cl-nv-verbose -cl-nv-maxrregcount=128";
+    return " -cl-nv-verbose -cl-nv-maxrregcount=128";
+  }
+  return "";
+}
+
+// getCompilerOptions outputs the options to build sha1.cl for commit on dev.
+static int getCompilerOptions(OpenCLdev& dev, const CommitMessage& commit,
+                              std::string& compilerOptions) {
+  // Specialize the kernel for this commit. The program cache keeps one
+  // binary for each layout of commit.
+  if (getKernelDefines(commit, compilerOptions)) {
+    return 1;
+  }
+  compilerOptions += getVendorOptions(dev);
+  return 0;
+}
+
+int findHash(OpenCLdev& dev, const CommitMessage& commit,
+             long long atime_hint, long long ctime_hint,
+             LeaseSource* leases, bool persistent, TraceWriter* trace) {
+  // The kernel is built for shaped, which starts as commit. When the times
+  // gain a digit, shaped gets the new times and the kernel is rebuilt.
+  CommitMessage shaped(commit);
+  for (;;) {
+    std::string compilerOptions;
+    if (getCompilerOptions(dev, shaped, compilerOptions)) {
+      return 1;
+    }
+    std::unique_ptr<OpenCLprog> prog;
+    if (openKernel(dev, sha1_cl, shaped, compilerOptions, prog)) {
+      fprintf(stderr, "openKernel failed\n");
+      return 1;
+    }
+    dev.unloadPlatformCompiler();
+    if (leases && leases->stopping()) {
+      return 0;  // The search ended while the kernel was built.
+    }
+
+    if (findOnGPU(dev, *prog, shaped, atime_hint, ctime_hint, leases,
+                  persistent, trace)) {
+      fprintf(stderr, "findOnGPU failed\n");
+      return 1;
+    }
+    if (!leases || leases->stopping()) {
+      return 0;
+    }
+    // findOnGPU only returns early when the times gained a digit.
+    if (leases->resume(atime_hint, ctime_hint)) {
+      fprintf(stderr, "the GPU cannot mine past a power of ten here, "
+              "it stops\n");
+      return 0;
+    }
+    shaped.set_atime(atime_hint);
+    shaped.set_ctime(ctime_hint);
+    fprintf(stderr, "rebuilding the kernel for atime=%lld ctime=%lld\n",
+            atime_hint, ctime_hint);
   }
-  OpenCLprog prog(codeBuf, dev);
-  if (prog.open(mainFuncName, compilerOptions)) {
-    fprintf(stderr, "prog.open(%s) failed\n", mainFuncName);
+}
+
+// openContext creates dev's context on its own platform.
+static int openContext(OpenCLdev& dev) {
+  // ctxProps is a list terminated with a "0, 0" pair.
+  const cl_context_properties ctxProps[] = {
+    CL_CONTEXT_PLATFORM,
+    reinterpret_cast<cl_context_properties>(dev.platId),
+    0, 0,
+  };
+  return dev.openCtx(ctxProps);
+}
+
+// getCalibrationCommit outputs the commit every device is timed with, so
+// that measured rates can be compared and cached across runs.
+static int getCalibrationCommit(CommitMessage& commit) {
+  const std::string body =
+      "tree 4b825dc642cb6eb9a060e54bf8d69288fbee4904\n"
+      "author git-mine <git-mine@localhost> 1541450000 +0000\n"
+      "committer git-mine <git-mine@localhost> 1541450000 +0000\n"
+      "\n"
+      "calibrate\n";
+  std::string raw = "commit " + std::to_string(body.size());
+  raw.push_back(0);
+  raw += body;
+  std::vector<char> buf(raw.begin(), raw.end());
+  buf.push_back(0);
+  return commit.set(buf.data(), raw.size());
+}
+
+// measureDevice outputs dev's hash rate on a short calibration batch. A rate
+// saved by an earlier run is used if there is one: cached is set to true.
+static int measureDevice(OpenCLdev& dev, float& rate, bool& cached) {
+  cached = !loadScore(dev, sha1_cl, rate);
+  if (cached) {
+    return 0;
+  }
+  CommitMessage commit;
+  std::string compilerOptions;
+  std::unique_ptr<OpenCLprog> prog;
+  if (getCalibrationCommit(commit) || openContext(dev) ||
+      getCompilerOptions(dev, commit, compilerOptions) ||
+      openKernel(dev, sha1_cl, commit, compilerOptions, prog) ||
+      benchKernel(dev, *prog, commit, rate)) {
+    fprintf(stderr, "measureDevice(%s) failed\n", dev.info.name.c_str());
     return 1;
   }
   dev.unloadPlatformCompiler();
-  free(codeBuf);
+  (void)saveScore(dev, sha1_cl, rate);
+  return 0;
+}
+
+// DevRank is a device and how fast it is.
+struct DevRank {
+  cl_device_id devId;
+  std::string name;
+  float rate;  // Measured hashes/sec, or 0 if it could not be measured.
+  float score;  // OpenCLdev::score, if no rate is known.
+  bool cached;
+};
 
-  if (findOnGPU(dev, prog, commit, atime_hint, ctime_hint)) {
-    fprintf(stderr, "findOnGPU failed\n");
+// rankDevices measures each of devs. If devs has only one device, it is not
+// measured unless measureAll is true. The fastest device is output first.
+static int rankDevices(cl_platform_id platId,
+                       const std::vector<cl_device_id>& devs, bool measureAll,
+                       std::vector<DevRank>& ranked) {
+  ranked.clear();
+  for (auto devId : devs) {
+    OpenCLdev dev(platId, devId);
+    if (dev.probe()) {
+      continue;
+    }
+    ranked.push_back(DevRank{devId, dev.info.name, 0, dev.score, false});
+    if ((devs.size() > 1 || measureAll) &&
+        measureDevice(dev, ranked.back().rate, ranked.back().cached)) {
+      ranked.back().rate = 0;
+    }
+  }
+  if (ranked.empty()) {
+    fprintf(stderr, "rankDevices: no usable device\n");
     return 1;
   }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const DevRank& a, const DevRank& b) {
+    if (a.rate != b.rate) {
+      return a.rate > b.rate;
+    }
+    return a.score > b.score;
+  });
   return 0;
 }
 
+// listDevices prints every device on every platform with its measured rate.
+int listDevices() {
+  std::vector<cl_platform_id> platforms;
+  if (getPlatforms(platforms)) {
+    return 1;
+  }
+  for (size_t i = 0; i < platforms.size(); i++) {
+    std::vector<cl_device_id> devs;
+    std::vector<DevRank> ranked;
+    if (getDeviceIds(platforms.at(i), devs) ||
+        rankDevices(platforms.at(i), devs, true, ranked)) {
+      return 1;
+    }
+    printf("platform [%zu]:\n", i);
+    for (size_t j = 0; j < ranked.size(); j++) {
+      const DevRank& r = ranked.at(j);
+      if (r.rate > 0) {
+        printf("  %s: %.3fM/s%s\n", r.name.c_str(), r.rate * 1e-6,
+               r.cached ? " (cached)" : "");
+      } else {
+        printf("  %s: failed\n", r.name.c_str());
+      }
+    }
+  }
+  return 0;
+}
+
+// selfTest runs selfTestKernel on every device on every platform. A CPU
+// platform such as PoCL can run it where there is no GPU.
+int selfTest(int cases, unsigned long seed) {
+  CommitMessage commit;
+  std::vector<cl_platform_id> platforms;
+  if (getCalibrationCommit(commit) || getPlatforms(platforms)) {
+    return 1;
+  }
+  printf("selftest: %d cases, seed %lu\n", cases, seed);
+  int failed = 0;
+  for (size_t i = 0; i < platforms.size(); i++) {
+    std::vector<cl_device_id> devs;
+    if (getDeviceIds(platforms.at(i), devs)) {
+      return 1;
+    }
+    for (auto devId : devs) {
+      OpenCLdev dev(platforms.at(i), devId);
+      if (dev.probe() || openContext(dev)) {
+        return 1;
+      }
+      printf("platform [%zu] %s:\n", i, dev.info.name.c_str());
+      fflush(stdout);
+      if (selfTestKernel(dev, sha1_cl, getVendorOptions(dev), commit, cases,
+                         seed)) {
+        failed++;
+      }
+      dev.unloadPlatformCompiler();
+    }
+  }
+  return failed ? 1 : 0;
+}
+
 int runOCL(const CommitMessage& commit, long long atime_hint,
-           long long ctime_hint) {
+           long long ctime_hint, LeaseSource* leases, bool persistent,
+           TraceWriter* trace) {
   std::vector<cl_platform_id> platforms;
   if (getPlatforms(platforms)) {
     return 1;
@@ -142,37 +323,27 @@ int runOCL(const CommitMessage& commit, long long atime_hint,
   }
   for (size_t i = 0; i < platforms.size(); i++) {
     std::vector<cl_device_id> devs;
-    if (getDeviceIds(platforms.at(i), devs)) {
+    std::vector<DevRank> ranked;
+    if (getDeviceIds(platforms.at(i), devs) ||
+        rankDevices(platforms.at(i), devs, false, ranked)) {
       return 1;
     }
-
-    size_t best = 0;
-    float bestScore = 0.0f;
-    for (size_t j = 0; j < devs.size(); j++) {
-      OpenCLdev dev(platforms.at(i), devs.at(j));
-      if (dev.probe()) {
-        return 1;
-      }
-      if (j == 0 || dev.score > bestScore) {
-        best = j;
-        bestScore = dev.score;
-      }
-    }
-    OpenCLdev dev(platforms.at(i), devs.at(best));
+    OpenCLdev dev(platforms.at(i), ranked.at(0).devId);
     if (dev.probe()) {
       return 1;
     }
     fprintf(stderr, "Selected OpenCL:\n");
     dev.dump();
+    if (ranked.at(0).rate > 0) {
+      fprintf(stderr, "  measured %.3fM/s\n", ranked.at(0).rate * 1e-6);
+    }
+    if (leases && leases->stopping()) {
+      return 0;
+    }
 
-    // ctxProps is a list terminated with a "0, 0" pair.
-    const cl_context_properties ctxProps[] = {
-      CL_CONTEXT_PLATFORM,
-      reinterpret_cast<cl_context_properties>(platforms.at(i)),
-      0, 0,
-    };
-    if (dev.openCtx(ctxProps) ||
-        findHash(dev, commit, atime_hint, ctime_hint)) {
+    if (openContext(dev) ||
+        findHash(dev, commit, atime_hint, ctime_hint, leases, persistent,
+                 trace)) {
       return 1;
     }
   }
@@ -182,16 +353,65 @@ int runOCL(const CommitMessage& commit, long long atime_hint,
 }  // namespace git-mine
 
 int main(int argc, char ** argv) {
-  if (argc != 3 && argc != 1) {
+  const char* workerOf = NULL;
+  bool persistent = false;
+  bool listDevices = false;
+  const char* tracePath = NULL;
+  if (argc > 1 && !strcmp(argv[1], "--selftest")) {
+    int cases = 1000;
+    unsigned long seed = time(NULL);
+    int n;
+    if (argc > 4 ||
+        (argc > 2 && (sscanf(argv[2], "%d%n", &cases, &n) != 1 ||
+                      (int)strlen(argv[2]) != n || cases < 1)) ||
+        (argc > 3 && (sscanf(argv[3], "%lu%n", &seed, &n) != 1 ||
+                      (int)strlen(argv[3]) != n))) {
+      fprintf(stderr, "Usage: %s --selftest [ cases [ seed ] ]\n", argv[0]);
+      return 1;
+    }
+    return gitmine::selfTest(cases, seed);
+  }
+  // Options come first. argv[0] is kept for the usage and git messages.
+  while (argc > 1 && (!strcmp(argv[1], "--persistent") ||
+                      !strcmp(argv[1], "--list-devices") ||
+                      (argc > 2 && !strcmp(argv[1], "--trace")))) {
+    int used = 1;
+    if (!strcmp(argv[1], "--persistent")) {
+      persistent = true;
+    } else if (!strcmp(argv[1], "--trace")) {
+      tracePath = argv[2];
+      used = 2;
+    } else {
+      listDevices = true;
+    }
+    argv[used] = argv[0];
+    argv += used;
+    argc -= used;
+  }
+  if (listDevices) {
+    if (argc != 1) {
+      fprintf(stderr, "Usage: %s --list-devices\n", argv[0]);
+      return 1;
+    }
+    return gitmine::listDevices();
+  }
+  if (argc == 3 && !strcmp(argv[1], "--worker")) {
+    workerOf = argv[2];
+  } else if (argc != 3 && argc != 1) {
     // This utility must be called from a post-commit hook
     // with $GIT_TOPLEVEL as the only argument.
-    fprintf(stderr, "Usage: %s [ atime_hint ctime_hint ]\n",
-            argv[0]);
+    fprintf(stderr, "Usage: %s [ --persistent ] [ --trace out.json ] "
+            "[ atime_hint ctime_hint ]\n"
+            "       %s [ --persistent ] [ --trace out.json ] "
+            "--worker host:port\n"
+            "       %s --list-devices\n"
+            "       %s --selftest [ cases [ seed ] ]\n",
+            argv[0], argv[0], argv[0], argv[0]);
     return 1;
   }
   long long atime_hint = 0;
   long long ctime_hint = 0;
-  if (argc == 3) {
+  if (argc == 3 && !workerOf) {
     int n;
     if (sscanf(argv[1], "%lld%n", &atime_hint, &n) != 1 ||
         (int)strlen(argv[1]) != n) {
@@ -206,7 +426,13 @@ int main(int argc, char ** argv) {
   }
 
   CommitMessage commit;
-  {
+  RemoteLeaseSource remote(argv[0]);
+  if (workerOf) {
+    // The coordinator sends the commit, so stdin is not used.
+    if (remote.open(workerOf, &commit)) {
+      return 1;
+    }
+  } else {
 #if 0
     FILE* f = fopen("/tmp/t.txt", "r");
     if (!f) {
@@ -220,6 +446,8 @@ int main(int argc, char ** argv) {
     if (reader.read_from(f, &commit)) {
       return 1;
     }
+  }
+  {
     Sha1Hash sha;
     Blake2Hash b2h;
     if (commit.hash(sha, b2h)) {
@@ -237,5 +465,28 @@ int main(int argc, char ** argv) {
     fprintf(stderr, "blake2: %s\n", buf);
   }
 
-  return gitmine::runOCL(commit, atime_hint, ctime_hint);
+  gitmine::TraceWriter trace;
+  if (tracePath && trace.open(tracePath)) {
+    return 1;
+  }
+  // Without a coordinator, the CPU mines until the GPU is ready for work.
+  CpuMiner cpu(commit, atime_hint, ctime_hint, MIN_MATCH_LEN + 1);
+  size_t nCPU = std::thread::hardware_concurrency();
+  if (!nCPU) {
+    nCPU = 1;
+  }
+  if (!workerOf) {
+    // Leave a core for the thread that sets up the GPU.
+    if (cpu.start(nCPU > 1 ? nCPU - 1 : 1)) {
+      return 1;
+    }
+  }
+  int r = gitmine::runOCL(commit, atime_hint, ctime_hint,
+                          workerOf ? static_cast<LeaseSource*>(&remote) : &cpu,
+                          persistent, tracePath ? &trace : NULL);
+  cpu.finish();
+  if (trace.close()) {
+    return 1;
+  }
+  return r;
 }
@@ -1,9 +1,16 @@
 #include "hashapi.h"
+#include "mine-lease.h"
+#include "mine-net.h"
 
+#include <sched.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <chrono>
 #include <condition_variable>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <thread>
@@ -66,16 +73,92 @@
  *    atime=1536024389  ctime=1546625046
  */
 
+// nonceIncrement adds 1 to the width digits at p. Returns 1 on overflow.
+static int nonceIncrement(char* p, size_t width, bool hex) {
+  for (size_t i = width; i-- > 0; ) {
+    if (p[i] == '9') {
+      if (hex) {
+        p[i] = 'a';
+        return 0;
+      }
+      p[i] = '0';
+    } else if (p[i] == 'f') {
+      p[i] = '0';
+    } else {
+      p[i]++;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// parseTzList parses a comma-separated list of timezone offsets (+HHMM or
+// -HHMM) into tzList.
+static int parseTzList(const char* arg, std::vector<std::string>& tzList) {
+  tzList.clear();
+  for (const char* p = arg; ; p++) {
+    size_t len = strcspn(p, ",");
+    std::string tz(p, len);
+    int hh, mm, n;
+    if (len != 5 || (tz[0] != '+' && tz[0] != '-') ||
+        strspn(tz.c_str() + 1, "0123456789") != 4 ||
+        sscanf(tz.c_str() + 1, "%2d%2d%n", &hh, &mm, &n) != 2 || n != 4 ||
+        hh > 14 || mm > 59) {
+      fprintf(stderr, "Invalid timezone \"%s\" in \"%s\" (want +HHMM)\n",
+              tz.c_str(), arg);
+      return 1;
+    }
+    tzList.push_back(tz);
+    p += len;
+    if (!*p) {
+      break;
+    }
+  }
+  return 0;
+}
+
 class MineBoss {
 public:
   CommitMessage orig;
 
-  void start() {
+  // ActiveLease tracks which ctimes of a lease are handed out and finished.
+  struct ActiveLease {
+    CtimeLease lease;
+    long long next_ctime;
+    size_t outstanding;
+  };
+
+  // MineJob is one commit being mined. The pool can mine several at once.
+  struct MineJob {
+    unsigned long long serial{0};
+    CommitMessage orig;
+    LeaseSource* leases{nullptr};
+    std::unique_ptr<LocalLeaseSource> localLeases;
+
+    // leaseMutex guards active, cur_lease, threads and exhausted.
+    std::map<unsigned long long, ActiveLease> active;
+    unsigned long long cur_lease{0};
+    size_t threads{0};
+    bool exhausted{false};  // In nonce mode, no more blocks to hand out.
+
+    // bossMutex guards the rest.
+    bool done{false};
+    size_t matchFound{0};
+    size_t matchThread{0};
+    CommitMessage match;
+
+    // In nonce mode, the hash state of everything before the nonce digits.
+    Sha1Hash prefixSha;
+    Blake2Hash prefixB2h;
+  };
+
+  // startPool starts one thread per CPU. Threads wait for addJob().
+  int startPool() {
     size_t nCPU = 0;
     FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
     if (!cpuinfo) {
       fprintf(stderr, "Failed to open /proc/cpuinfo: %d %s\n", errno, strerror(errno));
-      return;
+      return 1;
     }
     char buf[256];
     while (!feof(cpuinfo)) {
@@ -83,7 +166,7 @@ public:
         if (feof(cpuinfo)) break;
         fprintf(stderr, "Read /proc/cpuinfo failed: %d %s\n", errno,
                 strerror(errno));
-        return;
+        return 1;
       }
       buf[strcspn(buf, "\r\n")] = 0;
       if (!strncmp(buf, "processor", strlen("processor"))) {
@@ -103,8 +186,52 @@ public:
     fclose(cpuinfo);
     if (pool.size()) {
       fprintf(stderr, "pool not empty - already started?\n");
-      return;
+      return 1;
     }
+
+    // Lock bossMutex while adding threads to pool.
+    std::unique_lock<std::mutex> lock(bossMutex);
+    for (size_t i = 0; i < nCPU; i++) {
+      pool.emplace(pool.begin(), new ThreadLocal(this, i));
+    }
+    start_t = Clock::now();
+    return 0;
+  }
+
+  // addJob starts mining commit. If leases is NULL, a LocalLeaseSource
+  // starting at atime_first, ctime_first is used. In nonce mode, commit must
+  // already have its nonce (see set_nonce_width) and leases count blocks of
+  // NONCE_BLOCK nonces instead of ctimes.
+  std::shared_ptr<MineJob> addJob(const CommitMessage& commit,
+                                  long long atime_first, long long ctime_first,
+                                  LeaseSource* leases) {
+    std::shared_ptr<MineJob> job(new MineJob);
+    job->orig = commit;
+    job->leases = leases;
+    if (nonceWidth) {
+      std::string s = commit.toRawString();
+      size_t tail = commit.nonce.size() + commit.nonce_tail.size() +
+                    commit.log.size();
+      job->prefixSha.update(commit.header.data(), commit.header.size());
+      job->prefixSha.update(s.c_str(), s.size() - tail);
+      job->prefixB2h.update(commit.header.data(), commit.header.size());
+      job->prefixB2h.update(s.c_str(), s.size() - tail);
+      atime_first = 0;
+      ctime_first = 0;
+    }
+    if (!job->leases) {
+      job->localLeases.reset(new LocalLeaseSource(atime_first, ctime_first));
+      job->leases = job->localLeases.get();
+    }
+    std::unique_lock<std::mutex> lock(leaseMutex);
+    job->serial = ++last_serial;
+    jobs.push_back(job);
+    jobCond.notify_all();
+    return job;
+  }
+
+  // start mines orig, starting at atime_hint, ctime_hint.
+  void start() {
     if (atime_hint < orig.atime()) {
       if (atime_hint) {
         fprintf(stderr, "invalid atime_hint %lld (must be at least %lld)\n",
@@ -119,24 +246,29 @@ public:
       }
       ctime_hint = orig.ctime();
     }
-
-    // Lock bossMutex while adding threads to pool.
-    std::unique_lock<std::mutex> lock(bossMutex);
-    for (size_t i = 0; i < nCPU; i++) {
-      pool.emplace(pool.begin(), new ThreadLocal(this, i, nCPU));
+    if (startPool()) {
+      return;
     }
-    start_t = Clock::now();
+    addJob(orig, atime_hint, ctime_hint, leases);
   }
 
   void dumpMatchAt(size_t wantBest) {
-    CommitMessage noodle(orig);
     Sha1Hash sha;
     Blake2Hash b2h;
     for (size_t i = 0; i < pool.size(); i++) {
-      if (pool.at(i)->best >= wantBest) {
+      if (pool.at(i)->best >= wantBest && pool.at(i)->best_job) {
         fprintf(stderr, "Thread %zu says:\n", i);
-        noodle.set_atime(pool.at(i)->best_atime);
-        noodle.set_ctime(pool.at(i)->best_ctime);
+        CommitMessage noodle(pool.at(i)->best_job->orig);
+        if (nonceWidth) {
+          noodle.nonce = pool.at(i)->best_nonce;
+        } else {
+          noodle.set_atime(pool.at(i)->best_atime);
+          noodle.set_ctime(pool.at(i)->best_ctime);
+        }
+        if (!tzList.empty()) {
+          noodle.author_tz = pool.at(i)->best_author_tz;
+          noodle.committer_tz = pool.at(i)->best_committer_tz;
+        }
         noodle.hash(sha, b2h);
         char buf[1024];
         if (sha.dump(buf, sizeof(buf))) {
@@ -149,6 +281,10 @@ public:
           return;
         }
         fprintf(stderr, "blake2: %s\n", buf);
+        if (nonceWidth) {
+          fprintf(stderr, "nonce=%s\n", noodle.nonce.c_str());
+          return;
+        }
         fprintf(stderr, "author time=%lld\n", pool.at(i)->best_atime);
         fprintf(stderr, "committer  =%lld\n", pool.at(i)->best_ctime);
         return;
@@ -157,27 +293,208 @@ public:
     fprintf(stderr, "No best of %zu found.\n", wantBest);
   }
 
+  // takeDoneJobs returns the jobs that finished since the last call, and
+  // clears searchDone.
+  std::vector<std::shared_ptr<MineJob>> takeDoneJobs() {
+    std::unique_lock<std::mutex> lock(bossMutex);
+    std::vector<std::shared_ptr<MineJob>> r;
+    r.swap(doneJobs);
+    searchDone = false;
+    return r;
+  }
+
+  // commitMatch writes the match for job to the repo. If hint is true it
+  // prints how to reset a branch to it. Returns 1 on error.
+  int commitMatch(MineJob& job, bool hint = true) {
+    if (!job.matchFound) {
+      fprintf(stderr, "A thread set searchDone but didn't set matchFound.\n");
+      return 1;
+    }
+    Sha1Hash sha;
+    Blake2Hash b2h;
+    job.match.hash(sha, b2h);
+    return doGitCommit(job.matchThread, sha, b2h, job.match, hint);
+  }
+
   void commitMatch() {
-    for (size_t i = 0; i < pool.size(); i++) {
-      if (pool.at(i)->matchFound) {
-        commitMatchWith(*pool.at(i));
-        return;
+    for (auto& job : takeDoneJobs()) {
+      commitMatch(*job);
+    }
+  }
+
+  // reportMatch sends the match to leases instead of committing it here.
+  void reportMatch() {
+    for (auto& job : takeDoneJobs()) {
+      if (job->matchFound) {
+        job->leases->reportMatch(job->match.atime(), job->match.ctime(),
+                                 job->matchFound);
+      }
+    }
+  }
+
+  // heartbeat reports progress to leases. Returns 1 if mining should stop.
+  int heartbeat() {
+    long long total = 0;
+    size_t best = 0;
+    long long best_atime = 0, best_ctime = 0;
+    {
+      std::unique_lock<std::mutex> lock(bossMutex);
+      for (size_t i = 0; i < pool.size(); i++) {
+        total += pool.at(i)->count;
+        if (pool.at(i)->best > best) {
+          best = pool.at(i)->best;
+          best_atime = pool.at(i)->best_atime;
+          best_ctime = pool.at(i)->best_ctime;
+        }
       }
     }
-    fprintf(stderr, "A thread set searchDone but didn't set matchFound.\n");
+    if (best > reported_best) {
+      reported_best = best;
+      if (leases->reportMatch(best_atime, best_ctime, best)) {
+        return 1;
+      }
+    }
+    return leases->heartbeat(total * COUNT_DIVISOR);
   }
 
   enum {
-    terminateAt = 5,
+    DEFAULT_MATCH_LEN = 5,
     COUNT_DIVISOR = 16*1024,
+    NONCE_BLOCK = 1024*1024,
   };
 
   long long atime_hint;
   long long ctime_hint;
 
-  // printProgressAt1Hz returns 1 if all threads quit or if they should.
+  // A match of terminateAt bytes ends the search. A worker gets it from its
+  // coordinator.
+  size_t terminateAt{DEFAULT_MATCH_LEN};
+
+  // If nonceWidth is not 0, search the nonce header instead of the times.
+  size_t nonceWidth{0};
+  bool nonceHex{false};
+
+  // If tzList is not empty, also try each pair of author and committer
+  // timezones from it.
+  std::vector<std::string> tzList;
+
+  // In background mode threads run at low priority (SCHED_IDLE, or
+  // niceLevel if it is not 0), and throttle() parks some of them when other
+  // tasks are waiting for a CPU.
+  bool background{false};
+  int niceLevel{0};
+
+  enum {
+    // /proc/pressure/cpu "some avg10" (in %) above which threads are parked.
+    PSI_HIGH = 10,
+    // ... and below which one more thread may run.
+    PSI_LOW = 2,
+    // Without PSI, wait this long after each change for the 1-minute load
+    // average to catch up.
+    LOAD_SETTLE_SEC = 60,
+  };
+
+  // lowerPriority is called by each thread in background mode.
+  void lowerPriority(size_t id) {
+    if (niceLevel) {
+      // On Linux, setpriority on a tid only changes that thread.
+      if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), niceLevel)) {
+        fprintf(stderr, "Th%zu: setpriority(%d) failed: %d %s\n", id,
+                niceLevel, errno, strerror(errno));
+      }
+      return;
+    }
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    if (sched_setscheduler(0, SCHED_IDLE, &param)) {
+      fprintf(stderr, "Th%zu: SCHED_IDLE failed: %d %s\n", id, errno,
+              strerror(errno));
+    }
+  }
+
+  // throttle sets how many threads may run. It uses CPU pressure stall
+  // information if the kernel has it, else the load average.
+  void throttle() {
+    size_t n, max;
+    {
+      std::unique_lock<std::mutex> lock(bossMutex);
+      n = activeThreads < pool.size() ? activeThreads : pool.size();
+      max = pool.size();
+    }
+    size_t want = n;
+    double psi = 0, load = 0;
+    FILE* f = fopen("/proc/pressure/cpu", "r");
+    bool havePsi = f && fscanf(f, "some avg10=%lf", &psi) == 1;
+    if (f) {
+      fclose(f);
+    }
+    if (havePsi) {
+      // Back off quickly while other tasks are stalled, then creep back up.
+      if (psi > PSI_HIGH) {
+        want = n - (n + 3) / 4;
+      } else if (psi < PSI_LOW) {
+        want = n + 1;
+      }
+    } else {
+      f = fopen("/proc/loadavg", "r");
+      if (!f || fscanf(f, "%lf", &load) != 1) {
+        if (f) {
+          fclose(f);
+        }
+        return;
+      }
+      fclose(f);
+      // The load average lags by a minute, so it still counts threads that
+      // were just parked or woken. Move one thread at a time, and only once
+      // the last move shows in the average.
+      auto now = Clock::now();
+      if (now - lastLoadStep < std::chrono::seconds(LOAD_SETTLE_SEC)) {
+        return;
+      }
+      // load includes the threads that are running now. Leave the CPUs the
+      // rest of the load needs.
+      double others = load - n;
+      size_t target = (others < 0) ? max :
+          (size_t)(max - (others < max ? others : max));
+      if (target < n && n > 1) {
+        want = n - 1;
+      } else if (target > n) {
+        want = n + 1;
+      }
+      if (want != n) {
+        lastLoadStep = now;
+      }
+    }
+    if (want < 1) {
+      want = 1;
+    }
+    if (want > max) {
+      want = max;
+    }
+    if (want == n) {
+      return;
+    }
+    if (havePsi) {
+      fprintf(stderr, "background: %zu/%zu threads (cpu pressure %.1f%%)\n",
+              want, max, psi);
+    } else {
+      fprintf(stderr, "background: %zu/%zu threads (load %.2f)\n", want, max,
+              load);
+    }
+    std::unique_lock<std::mutex> lock(bossMutex);
+    activeThreads = want;
+    cond.notify_all();
+  }
+
+  // leases hands out the ctimes of orig to search. If NULL, start() uses a
+  // LocalLeaseSource starting at atime_hint, ctime_hint.
+  LeaseSource* leases{nullptr};
+
+  // printProgressAt1Hz returns 1 if a job is done, or if all threads quit.
   int printProgressAt1Hz() {
-    long long total_work = (ctime_hint - atime_hint) / COUNT_DIVISOR;
+    // The hints bound the times, not the nonces, so nonce mode has no total.
+    long long total_work = nonceWidth ? 0 :
+                           (ctime_hint - atime_hint) / COUNT_DIVISOR;
     auto t0 = Clock::now();
     // lock is needed for cond.wait_until.
     std::unique_lock<std::mutex> lock(bossMutex);
@@ -210,16 +527,28 @@ public:
 
       // Report progress if a full second passed.
       std::chrono::duration<float> elapsed_sec = t0 - start_t;
-      fprintf(stderr, "%4.1fs progress: %7.2f%%   best:%zu  100%%=%.2f MHash\n",
-              elapsed_sec.count(),
-              100.0f*float(total)/float(total_work), best,
-              float(total_work) * COUNT_DIVISOR / 1e6);
+      if (total_work > 0) {
+        fprintf(stderr, "%4.1fs progress: %7.2f%%   best:%zu  "
+                "100%%=%.2f MHash\n", elapsed_sec.count(),
+                100.0f*float(total)/float(total_work), best,
+                float(total_work) * COUNT_DIVISOR / 1e6);
+      } else {
+        // Range, worker and nonce modes only print the rate.
+        fprintf(stderr, "%4.1fs progress: %.2f MHash/s   best:%zu\n",
+                elapsed_sec.count(),
+                float(total) * COUNT_DIVISOR / 1e6 / elapsed_sec.count(),
+                best);
+      }
       if (best > last_best) {
         last_best = best;
         dumpMatchAt(best);
       }
       break;
     }
+    if (background) {
+      lock.unlock();
+      throttle();
+    }
     return 0;
   }
 
@@ -229,6 +558,11 @@ public:
       stopRequested = true;
       cond.notify_all();
     }
+    {
+      // Wake threads waiting for a job.
+      std::unique_lock<std::mutex> lock(leaseMutex);
+      jobCond.notify_all();
+    }
     // Wait for threads to quit.
     for (size_t patience = 5; ; patience--) {
       if (!patience) {
@@ -258,61 +592,87 @@ public:
 private:
   typedef std::chrono::steady_clock Clock;
   Clock::time_point start_t;
+  Clock::time_point lastLoadStep;  // When throttle() last moved a thread.
   size_t last_best{0};
+  size_t reported_best{0};
 
   struct ThreadLocal {
-    ThreadLocal(MineBoss* parent_, size_t id, size_t idMax)
+    ThreadLocal(MineBoss* parent_, size_t id)
       : parent(parent_)
-      , th(&ThreadLocal::worker, this)
-      , noodle(parent_->orig)
       , id(id)
-      , idMax(idMax) {}
+      , th(&ThreadLocal::worker, this) {}
 
     ~ThreadLocal() {
       th.join();
     }
     MineBoss* parent;
-    std::thread th;
     long long commit_delta{0};
     CommitMessage noodle;
+    unsigned long long noodle_serial{0};  // Which job noodle is a copy of.
 
     bool go{true};
     bool bossSaidGo{true};
     size_t id;
-    size_t idMax;
-    size_t matchFound{0};
+    std::shared_ptr<MineJob> job;  // The job being searched.
+    unsigned long long lease_id{0};  // Lease of the ctime being searched.
     volatile size_t best{0};
+    std::shared_ptr<MineJob> best_job;
     long long best_atime{0};
     long long best_ctime{0};
+    std::string best_nonce;
+    std::string best_author_tz;
+    std::string best_committer_tz;
+    std::string tail;  // In nonce mode, the nonce digits and what follows.
     Sha1Hash sha;
     Blake2Hash b2h;
 
     long long count{0};
+    // uncounted is how many hashes were done since the last checkIn(). It
+    // carries over between ctimes, which can have far fewer than
+    // COUNT_DIVISOR atimes each.
+    long long uncounted{0};
+
+    // th is the last member, so the thread starts after the rest are built.
+    std::thread th;
 
     void worker() {
+      if (parent->background) {
+        parent->lowerPriority(id);
+      }
       doWork();
       std::unique_lock<std::mutex> lock(parent->bossMutex);
       go = false;
       parent->cond.notify_all();
     }
 
-    // search returns 1 if a match was found or there is some other reason
-    // to abort the search.
+    // checkIn is called every COUNT_DIVISOR hashes. It parks the thread
+    // while the boss wants fewer threads running. Returns 1 if the pool
+    // should stop, -1 if job is done, or 0 to keep going.
+    int checkIn() {
+      std::unique_lock<std::mutex> lock(parent->bossMutex);
+      count++;
+      while (id >= parent->activeThreads && !parent->stopRequested &&
+             !job->done) {
+        parent->cond.wait(lock);
+      }
+      if (parent->stopRequested) {
+        return 1;
+      }
+      if (job->done) {
+        return -1;
+      }
+      return 0;
+    }
+
+    // search returns 1 if the pool should stop. If job is done, search
+    // returns 0 early.
     int search(long long atime) {
-      float total_work = float(noodle.ctime() - atime);
-      // Use floats to trade off accuracy for avoiding overflow.
-      long long my_work_start =
-          (long long) ((float(id) * total_work) / float(idMax)) + atime;
-      long long my_work_end =
-          (long long) ((float(id + 1) * total_work) / float(idMax)) + atime;
-      int my_count = 1;
-      for (long long t = my_work_start; t < my_work_end; t++, my_count++) {
-        if ((my_count & (COUNT_DIVISOR - 1)) == 0) {
-          my_count = 0;
-          std::unique_lock<std::mutex> lock(parent->bossMutex);
-          count++;
-          if (parent->stopRequested) {
-            return 1;
+      for (long long t = atime; t <= noodle.ctime(); t++) {
+        if (++uncounted == COUNT_DIVISOR) {
+          uncounted = 0;
+          int r = checkIn();
+          if (r) {
+            return r > 0;
           }
         }
         noodle.set_atime(t);
@@ -321,56 +681,623 @@ private:
         int match = b2h.instr(sha.result, sizeof(sha.result), &matchlen);
         if (match != -1) {
           if (matchlen > best) {
+            std::unique_lock<std::mutex> lock(parent->bossMutex);
             best = matchlen;
+            best_job = job;
             best_atime = t;
             best_ctime = noodle.ctime();
           }
-          if (matchlen >= terminateAt) {
+          if (matchlen >= parent->terminateAt) {
             // Signal that a match was found.
             std::unique_lock<std::mutex> lock(parent->bossMutex);
-            matchFound = 1;
-            parent->searchDone = true;
-            parent->cond.notify_all();
-            return 1;
+            if (!job->done) {
+              job->done = true;
+              job->matchFound = matchlen;
+              job->matchThread = id;
+              job->match = noodle;
+              parent->doneJobs.push_back(job);
+              parent->searchDone = true;
+              parent->cond.notify_all();
+            }
+            return 0;
+          }
+        }
+      }
+      return 0;
+    }
+
+    // searchTz is search() that also tries every pair of timezones in
+    // tzList. The hash state is saved before author_tz and before
+    // committer_tz, so each timezone only hashes what follows it.
+    int searchTz(long long atime) {
+      const std::vector<std::string>& tzs = parent->tzList;
+      if (noodle.author_tz.size() < 6 || noodle.author_tz[0] != ' ' ||
+          noodle.committer_tz.size() < 6 || noodle.committer_tz[0] != ' ') {
+        fprintf(stderr, "Th%zu: unable to find timezones to search\n", id);
+        parent->finishJob(job);
+        return 0;
+      }
+      std::string mid = noodle.committer + noodle.committer_time;
+      std::string rest = noodle.toRawString();
+      rest.erase(0, noodle.parent.size() + noodle.author.size() +
+                 noodle.author_time.size() + noodle.author_tz.size() +
+                 mid.size() + noodle.committer_tz.size());
+
+      // sha0 and b2h0 hash up to author_time. That includes the header,
+      // which holds the length of the commit, so they are rebuilt each time
+      // author_time gains a digit.
+      Sha1Hash sha0;
+      Blake2Hash b2h0;
+      size_t atimeDigits = 0;
+      for (long long t = atime; t <= noodle.ctime(); t++) {
+        noodle.set_atime(t);
+        if (noodle.author_time.size() != atimeDigits) {
+          atimeDigits = noodle.author_time.size();
+          sha0 = Sha1Hash();
+          sha0.update(noodle.header.data(), noodle.header.size());
+          sha0.update(noodle.parent.c_str(), noodle.parent.size());
+          sha0.update(noodle.author.c_str(), noodle.author.size());
+          b2h0 = Blake2Hash();
+          b2h0.update(noodle.header.data(), noodle.header.size());
+          b2h0.update(noodle.parent.c_str(), noodle.parent.size());
+          b2h0.update(noodle.author.c_str(), noodle.author.size());
+        }
+        Sha1Hash shaA = sha0;
+        Blake2Hash b2hA = b2h0;
+        shaA.update(noodle.author_time.c_str(), noodle.author_time.size());
+        b2hA.update(noodle.author_time.c_str(), noodle.author_time.size());
+        for (auto& atz : tzs) {
+          noodle.author_tz.replace(1, 5, atz);
+          Sha1Hash shaC = shaA;
+          Blake2Hash b2hC = b2hA;
+          shaC.update(noodle.author_tz.c_str(), noodle.author_tz.size());
+          shaC.update(mid.c_str(), mid.size());
+          b2hC.update(noodle.author_tz.c_str(), noodle.author_tz.size());
+          b2hC.update(mid.c_str(), mid.size());
+          for (auto& ctz : tzs) {
+            if (++uncounted == COUNT_DIVISOR) {
+              uncounted = 0;
+              int r = checkIn();
+              if (r) {
+                return r > 0;
+              }
+            }
+            noodle.committer_tz.replace(1, 5, ctz);
+            sha = shaC;
+            sha.update(noodle.committer_tz.c_str(), noodle.committer_tz.size());
+            sha.update(rest.c_str(), rest.size());
+            sha.flush();
+            b2h = b2hC;
+            b2h.update(noodle.committer_tz.c_str(), noodle.committer_tz.size());
+            b2h.update(rest.c_str(), rest.size());
+            b2h.flush();
+            size_t matchlen = 0;
+            int match = b2h.instr(sha.result, sizeof(sha.result), &matchlen);
+            if (match == -1) {
+              continue;
+            }
+            if (matchlen > best) {
+              std::unique_lock<std::mutex> lock(parent->bossMutex);
+              best = matchlen;
+              best_job = job;
+              best_atime = t;
+              best_ctime = noodle.ctime();
+              best_author_tz = noodle.author_tz;
+              best_committer_tz = noodle.committer_tz;
+            }
+            if (matchlen >= parent->terminateAt) {
+              // Signal that a match was found.
+              std::unique_lock<std::mutex> lock(parent->bossMutex);
+              if (!job->done) {
+                job->done = true;
+                job->matchFound = matchlen;
+                job->matchThread = id;
+                job->match = noodle;
+                parent->doneJobs.push_back(job);
+                parent->searchDone = true;
+                parent->cond.notify_all();
+              }
+              return 0;
+            }
+          }
+        }
+      }
+      return 0;
+    }
+
+    // searchNonce tries NONCE_BLOCK nonces starting at block * NONCE_BLOCK.
+    // Only tail is hashed for each one, starting from the job's midstate.
+    // Returns 1 if the pool should stop.
+    int searchNonce(long long block) {
+      size_t width = noodle.nonce.size();
+      char buf[64];
+      int n = snprintf(buf, sizeof(buf), parent->nonceHex ? "%0*llx" : "%0*llu",
+                       (int)width, (unsigned long long)block * NONCE_BLOCK);
+      if (n < 0 || (size_t)n > width) {
+        // Every nonce of this width was handed out.
+        parent->exhaustJob(*job);
+        return 0;
+      }
+      memcpy(&tail[0], buf, width);
+      for (long long i = 0; i < NONCE_BLOCK; i++) {
+        if (++uncounted == COUNT_DIVISOR) {
+          uncounted = 0;
+          int r = checkIn();
+          if (r) {
+            return r > 0;
           }
         }
+        sha = job->prefixSha;
+        sha.update(tail.c_str(), tail.size());
+        sha.flush();
+        b2h = job->prefixB2h;
+        b2h.update(tail.c_str(), tail.size());
+        b2h.flush();
+        size_t matchlen = 0;
+        int match = b2h.instr(sha.result, sizeof(sha.result), &matchlen);
+        if (match != -1) {
+          if (matchlen > best) {
+            std::unique_lock<std::mutex> lock(parent->bossMutex);
+            best = matchlen;
+            best_job = job;
+            best_nonce = tail.substr(0, width);
+          }
+          if (matchlen >= parent->terminateAt) {
+            // Signal that a match was found.
+            std::unique_lock<std::mutex> lock(parent->bossMutex);
+            if (!job->done) {
+              job->done = true;
+              job->matchFound = matchlen;
+              job->matchThread = id;
+              job->match = noodle;
+              job->match.nonce = tail.substr(0, width);
+              parent->doneJobs.push_back(job);
+              parent->searchDone = true;
+              parent->cond.notify_all();
+            }
+            return 0;
+          }
+        }
+        if (nonceIncrement(&tail[0], width, parent->nonceHex)) {
+          parent->exhaustJob(*job);
+          return 0;
+        }
       }
       return 0;
     }
 
     void doWork() {
-      noodle.set_ctime(parent->ctime_hint);
-      for (;;) {
-        if (search(parent->atime_hint)) {
+      long long atime, ctime;
+      // Each thread claims a whole ctime and searches all its atimes.
+      // In nonce mode, ctime is the nonce block instead.
+      while (!parent->claimCtime(*this, &atime, &ctime)) {
+        if (noodle_serial != job->serial) {
+          noodle_serial = job->serial;
+          noodle = job->orig;
+          tail = noodle.nonce + noodle.nonce_tail + noodle.log;
+        }
+        if (parent->nonceWidth) {
+          if (searchNonce(ctime)) {
+            return;
+          }
+          continue;
+        }
+        noodle.set_ctime(ctime);
+        if (parent->tzList.empty() ? search(atime) : searchTz(atime)) {
           return;
         }
-
-        // Increment ctime and try again.
         commit_delta++;
-        noodle.set_ctime(noodle.ctime() + 1);
       }
     }
   };
 
-  void commitMatchWith(ThreadLocal& th) {
-    doGitCommit(th.id, th.sha, th.b2h, th.noodle);
+  // finishJob marks job done without a match. bossMutex must be unlocked.
+  void finishJob(const std::shared_ptr<MineJob>& job) {
+    std::unique_lock<std::mutex> lock(bossMutex);
+    if (!job->done) {
+      job->done = true;
+      doneJobs.push_back(job);
+      searchDone = true;
+      cond.notify_all();
+    }
+  }
+
+  // exhaustJob stops handing out nonce blocks of job because the nonce width
+  // has no more. claimCtime finishes job once every block that was already
+  // handed out is done, since a lower one can still match.
+  void exhaustJob(MineJob& job) {
+    std::unique_lock<std::mutex> lock(leaseMutex);
+    job.exhausted = true;
   }
 
+  // claimCtime marks the ctime th was searching as finished and claims the
+  // next one from the job with the fewest threads, waiting for addJob() if
+  // there are no jobs. Returns 1 if the pool should stop.
+  int claimCtime(ThreadLocal& th, long long* atime, long long* ctime) {
+    std::unique_lock<std::mutex> lock(leaseMutex);
+    if (th.job) {
+      MineJob& job = *th.job;
+      auto i = job.active.find(th.lease_id);
+      if (i != job.active.end() && !--i->second.outstanding &&
+          i->second.next_ctime >= i->second.lease.ctime_end) {
+        job.leases->done(i->second.lease);
+        job.active.erase(i);
+      }
+      job.threads--;
+      if (job.exhausted && !job.threads) {
+        finishJob(th.job);
+      }
+      th.job.reset();
+      th.lease_id = 0;
+    }
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(bossMutex);
+        if (stopRequested) {
+          return 1;
+        }
+        for (auto j = jobs.begin(); j != jobs.end(); ) {
+          if ((*j)->done) {
+            j = jobs.erase(j);
+          } else {
+            j++;
+          }
+        }
+      }
+      std::shared_ptr<MineJob> job;
+      for (auto& j : jobs) {
+        if (j->exhausted) {
+          continue;
+        }
+        if (!job || j->threads < job->threads) {
+          job = j;
+        }
+      }
+      if (!job) {
+        jobCond.wait(lock);
+        continue;
+      }
+      auto i = job->active.find(job->cur_lease);
+      if (i == job->active.end() ||
+          i->second.next_ctime >= i->second.lease.ctime_end) {
+        ActiveLease a;
+        if (job->leases->next(a.lease)) {
+          finishJob(job);
+          continue;
+        }
+        a.next_ctime = a.lease.ctime_first;
+        a.outstanding = 0;
+        job->cur_lease = a.lease.id;
+        i = job->active.emplace(job->cur_lease, a).first;
+      }
+      job->threads++;
+      th.job = job;
+      th.lease_id = i->first;
+      i->second.outstanding++;
+      *atime = i->second.lease.atime_first;
+      *ctime = i->second.next_ctime++;
+      return 0;
+    }
+  }
+
+  // leaseMutex and jobCond guard jobs and the lease state of each job.
+  std::mutex leaseMutex;
+  std::condition_variable jobCond;
+  std::vector<std::shared_ptr<MineJob>> jobs;
+  unsigned long long last_serial{0};
+
   // bossMutex and cond guard the rest of the members of this class.
   std::mutex bossMutex;
   std::condition_variable cond;
   bool stopRequested{false};
   bool searchDone{false};
+  std::vector<std::shared_ptr<MineJob>> doneJobs;
+  size_t activeThreads{(size_t)-1};  // Threads with a higher id are parked.
 
   std::vector<std::shared_ptr<ThreadLocal>> pool;
 };
 
+// RangeCommit is one commit in a --range.
+struct RangeCommit {
+  std::string oldHash;
+  std::vector<std::string> parents;  // Old hashes of all parents.
+  size_t waitingFor{0};  // Parents in the range that are not mined yet.
+  std::vector<size_t> children;  // Commits in the range with this parent.
+  std::shared_ptr<MineBoss::MineJob> job;
+};
+
+// startRangeCommit points the parent lines of c at the mined parents and
+// hands it to the pool.
+static int startRangeCommit(MineBoss& boss, const char* whoami,
+                            RangeCommit& c,
+                            const std::map<std::string, std::string>& mined) {
+  std::string raw;
+  if (runGit({"cat-file", "commit", c.oldHash}, raw)) {
+    return 1;
+  }
+  FILE* f = fmemopen(&raw[0], raw.size(), "r");
+  if (!f) {
+    fprintf(stderr, "fmemopen failed: %d %s\n", errno, strerror(errno));
+    return 1;
+  }
+  CommitMessage commit;
+  CommitReader reader(whoami);
+  int r = reader.read_from(f, &commit);
+  fclose(f);
+  if (r) {
+    fprintf(stderr, "%s: unable to parse commit %s\n", whoami,
+            c.oldHash.c_str());
+    return 1;
+  }
+  for (auto& p : c.parents) {
+    auto m = mined.find(p);
+    if (m == mined.end()) {
+      continue;
+    }
+    size_t pos = commit.parent.find("parent " + p);
+    if (pos == std::string::npos) {
+      fprintf(stderr, "%s: commit %s: parent %s not found\n", whoami,
+              c.oldHash.c_str(), p.c_str());
+      return 1;
+    }
+    commit.parent.replace(pos + 7, p.size(), m->second);
+  }
+  if (boss.nonceWidth && commit.set_nonce_width(boss.nonceWidth)) {
+    return 1;
+  }
+  c.job = boss.addJob(commit, commit.atime(), commit.ctime(), NULL);
+  return 0;
+}
+
+// mineRange mines every commit in range (anything git rev-list accepts, such
+// as base..tip) oldest first, re-parenting each one onto its mined parents.
+// Side branches are mined at the same time. Refs that pointed at an old
+// commit are updated once every commit is mined.
+static int mineRange(MineBoss& boss, const char* whoami, const char* range) {
+  std::string out;
+  if (runGit({"rev-list", "--reverse", "--topo-order", "--parents", range},
+             out)) {
+    return 1;
+  }
+  std::vector<RangeCommit> commits;
+  std::map<std::string, size_t> index;
+  for (size_t pos = 0; pos < out.size(); ) {
+    size_t end = out.find("\n", pos);
+    if (end == std::string::npos) {
+      end = out.size();
+    }
+    std::string line = out.substr(pos, end - pos);
+    pos = end + 1;
+    if (line.empty()) {
+      continue;
+    }
+    commits.emplace_back();
+    RangeCommit& c = commits.back();
+    for (size_t i = 0; i < line.size(); ) {
+      size_t sp = line.find(" ", i);
+      if (sp == std::string::npos) {
+        sp = line.size();
+      }
+      if (c.oldHash.empty()) {
+        c.oldHash = line.substr(i, sp - i);
+      } else {
+        c.parents.push_back(line.substr(i, sp - i));
+      }
+      i = sp + 1;
+    }
+    index[c.oldHash] = commits.size() - 1;
+  }
+  if (commits.empty()) {
+    fprintf(stderr, "%s: no commits in %s\n", whoami, range);
+    return 1;
+  }
+  for (size_t i = 0; i < commits.size(); i++) {
+    for (auto& p : commits.at(i).parents) {
+      auto j = index.find(p);
+      if (j != index.end()) {
+        commits.at(i).waitingFor++;
+        commits.at(j->second).children.push_back(i);
+      }
+    }
+  }
+  fprintf(stderr, "Mining %zu commits in %s\n", commits.size(), range);
+
+  if (boss.startPool()) {
+    return 1;
+  }
+  std::map<std::string, std::string> mined;  // Old hash to new hash.
+  std::map<MineBoss::MineJob*, size_t> byJob;
+  for (size_t i = 0; i < commits.size(); i++) {
+    if (!commits.at(i).waitingFor) {
+      if (startRangeCommit(boss, whoami, commits.at(i), mined)) {
+        boss.stop();
+        return 1;
+      }
+      byJob[commits.at(i).job.get()] = i;
+    }
+  }
+  while (mined.size() < commits.size()) {
+    if (!boss.printProgressAt1Hz()) {
+      continue;
+    }
+    auto done = boss.takeDoneJobs();
+    if (done.empty()) {
+      fprintf(stderr, "%s: all threads quit\n", whoami);
+      boss.stop();
+      return 1;
+    }
+    for (auto& job : done) {
+      RangeCommit& c = commits.at(byJob.at(job.get()));
+      // The refs are updated at the end, so there is no hint to print.
+      if (boss.commitMatch(*job, false)) {
+        boss.stop();
+        return 1;
+      }
+      Sha1Hash sha;
+      Blake2Hash b2h;
+      job->match.hash(sha, b2h);
+      char buf[1024];
+      if (sha.dump(buf, sizeof(buf))) {
+        boss.stop();
+        return 1;
+      }
+      mined[c.oldHash] = buf;
+      fprintf(stderr, "%s -> %s (%zu/%zu)\n", c.oldHash.c_str(), buf,
+              mined.size(), commits.size());
+      c.job.reset();
+      for (size_t child : c.children) {
+        if (!--commits.at(child).waitingFor) {
+          if (startRangeCommit(boss, whoami, commits.at(child), mined)) {
+            boss.stop();
+            return 1;
+          }
+          byJob[commits.at(child).job.get()] = child;
+        }
+      }
+    }
+  }
+  boss.stop();
+
+  // Update the refs only after the whole range is mined. Only branches are
+  // moved: tags and remote-tracking branches are left alone.
+  if (runGit({"for-each-ref", "--format=%(objectname) %(refname)",
+              "refs/heads/"}, out)) {
+    return 1;
+  }
+  // A detached HEAD is not in for-each-ref, so it is moved explicitly.
+  std::string head;
+  if (runGit({"rev-parse", "--symbolic-full-name", "HEAD"}, head)) {
+    return 1;
+  }
+  if (head == "HEAD\n") {
+    if (runGit({"rev-parse", "HEAD"}, head)) {
+      return 1;
+    }
+    out += head.substr(0, head.find("\n")) + " HEAD\n";
+  }
+  for (size_t pos = 0; pos < out.size(); ) {
+    size_t end = out.find("\n", pos);
+    if (end == std::string::npos) {
+      end = out.size();
+    }
+    std::string line = out.substr(pos, end - pos);
+    pos = end + 1;
+    size_t sp = line.find(" ");
+    if (sp == std::string::npos) {
+      continue;
+    }
+    auto m = mined.find(line.substr(0, sp));
+    if (m == mined.end()) {
+      continue;
+    }
+    std::string ref = line.substr(sp + 1);
+    std::string ignored;
+    if (runGit({"update-ref", "--no-deref", "-m", "git-mine --range", ref,
+                m->second, m->first}, ignored)) {
+      return 1;
+    }
+    fprintf(stderr, "updated %s to %s\n", ref.c_str(), m->second.c_str());
+  }
+  return 0;
+}
+
 int main(int argc, char ** argv) {
-  if (argc != 3 && argc != 1) {
+  const char* coordinatorPort = NULL;
+  const char* workerOf = NULL;
+  size_t nonceWidth = 0;
+  bool nonceHex = false;
+  std::vector<std::string> tzList;
+  bool background = false;
+  int niceLevel = 0;
+  size_t matchLen = MineBoss::DEFAULT_MATCH_LEN;
+  // Options that change what is searched, and how, come first.
+  while (argc > 1) {
+    int used = 2;
+    if (!strcmp(argv[1], "--background")) {
+      background = true;
+      used = 1;
+    } else if (argc < 3) {
+      break;
+    } else if (!strcmp(argv[1], "--nice")) {
+      int n;
+      if (sscanf(argv[2], "%d%n", &niceLevel, &n) != 1 ||
+          (int)strlen(argv[2]) != n || niceLevel < 1 || niceLevel > 19) {
+        fprintf(stderr, "Invalid nice level: \"%s\" (want 1-19)\n", argv[2]);
+        return 1;
+      }
+      background = true;
+    } else if (!strcmp(argv[1], "--nonce") ||
+               !strcmp(argv[1], "--nonce-hex")) {
+      nonceHex = !strcmp(argv[1], "--nonce-hex");
+      int n;
+      if (sscanf(argv[2], "%zu%n", &nonceWidth, &n) != 1 ||
+          (int)strlen(argv[2]) != n || nonceWidth < 1 || nonceWidth > 16) {
+        fprintf(stderr, "Invalid nonce width: \"%s\" (want 1-16)\n",
+                argv[2]);
+        return 1;
+      }
+    } else if (!strcmp(argv[1], "--match-len")) {
+      int n;
+      if (sscanf(argv[2], "%zu%n", &matchLen, &n) != 1 ||
+          (int)strlen(argv[2]) != n || matchLen < 1 || matchLen > 20) {
+        fprintf(stderr, "Invalid match length: \"%s\" (want 1-20)\n",
+                argv[2]);
+        return 1;
+      }
+    } else if (!strcmp(argv[1], "--tz")) {
+      if (parseTzList(argv[2], tzList)) {
+        return 1;
+      }
+    } else {
+      break;
+    }
+    argv[used] = argv[0];
+    argc -= used;
+    argv += used;
+  }
+  if (nonceWidth && !tzList.empty()) {
+    fprintf(stderr, "--nonce and --tz cannot be used together\n");
+    return 1;
+  }
+  if (argc == 3 && !strcmp(argv[1], "--range")) {
+    if (matchLen != MineBoss::DEFAULT_MATCH_LEN) {
+      fprintf(stderr, "--match-len only works with --coordinator\n");
+      return 1;
+    }
+    MineBoss boss;
+    boss.atime_hint = 0;
+    boss.ctime_hint = 0;
+    boss.nonceWidth = nonceWidth;
+    boss.nonceHex = nonceHex;
+    boss.tzList = tzList;
+    boss.background = background;
+    boss.niceLevel = niceLevel;
+    return mineRange(boss, argv[0], argv[2]);
+  }
+  if (argc > 2 && !strcmp(argv[1], "--coordinator")) {
+    coordinatorPort = argv[2];
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  } else if (argc == 3 && !strcmp(argv[1], "--worker")) {
+    workerOf = argv[2];
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc != 3 && argc != 1) ||
+      ((nonceWidth || !tzList.empty()) && (coordinatorPort || workerOf)) ||
+      (matchLen != MineBoss::DEFAULT_MATCH_LEN && !coordinatorPort)) {
     // This utility must be called from a post-commit hook
     // with $GIT_TOPLEVEL as the only argument.
-    fprintf(stderr, "Usage: %s [ atime_hint ctime_hint ]\n",
-            argv[0]);
+    fprintf(stderr, "Usage: %s [ options ] [ atime_hint ctime_hint ]\n"
+            "       %s [ --match-len n ] --coordinator port "
+            "[ atime_hint ctime_hint ]\n"
+            "       %s --worker host:port\n"
+            "       %s [ options ] --range base..tip\n"
+            "options: --nonce width | --nonce-hex width | --tz +HHMM,-HHMM...\n"
+            "         --background | --nice level\n",
+            argv[0], argv[0], argv[0], argv[0]);
     return 1;
   }
   long long atime_hint = 0;
@@ -392,12 +1319,33 @@ int main(int argc, char ** argv) {
   MineBoss boss;
   boss.atime_hint = atime_hint;
   boss.ctime_hint = ctime_hint;
-  {
+  RemoteLeaseSource remote(argv[0]);
+  if (workerOf) {
+    // The coordinator sends the commit, so stdin is not used.
+    if (remote.open(workerOf, &boss.orig)) {
+      return 1;
+    }
+    boss.leases = &remote;
+    boss.terminateAt = remote.matchLen();
+  } else {
     FILE* f = stdin;
     CommitReader reader(argv[0]);
     if (reader.read_from(f, &boss.orig)) {
       return 1;
     }
+  }
+  if (nonceWidth) {
+    // Search a nonce header instead of the times.
+    if (boss.orig.set_nonce_width(nonceWidth)) {
+      return 1;
+    }
+    boss.nonceWidth = nonceWidth;
+    boss.nonceHex = nonceHex;
+  }
+  boss.tzList = tzList;
+  boss.background = background;
+  boss.niceLevel = niceLevel;
+  {
     Sha1Hash sha;
     Blake2Hash b2h;
     if (boss.orig.hash(sha, b2h)) {
@@ -410,9 +1358,33 @@ int main(int argc, char ** argv) {
     fprintf(stderr, "Signing commit: %s\n", shabuf);
   }
 
+  if (coordinatorPort) {
+    int port, n;
+    if (sscanf(coordinatorPort, "%d%n", &port, &n) != 1 ||
+        (int)strlen(coordinatorPort) != n || port < 1 || port > 65535) {
+      fprintf(stderr, "Invalid port: \"%s\"\n", coordinatorPort);
+      return 1;
+    }
+    if (atime_hint < boss.orig.atime()) {
+      atime_hint = boss.orig.atime();
+    }
+    if (ctime_hint < boss.orig.ctime()) {
+      ctime_hint = boss.orig.ctime();
+    }
+    MineCoordinator coordinator(boss.orig, atime_hint, ctime_hint, matchLen);
+    if (coordinator.listen(port) || coordinator.run()) {
+      return 1;
+    }
+    return 0;
+  }
+
   boss.start();
   for (size_t i = 90;;) {
     if (boss.printProgressAt1Hz()) break;
+    if (workerOf && boss.heartbeat()) {
+      fprintf(stderr, "coordinator said stop\n");
+      break;
+    }
     i--;
     i++;
     if (!i) {
@@ -421,7 +1393,11 @@ int main(int argc, char ** argv) {
     }
   }
   if (boss.getSearchDone()) {
-    boss.commitMatch();
+    if (workerOf) {
+      boss.reportMatch();
+    } else {
+      boss.commitMatch();
+    }
   }
   boss.stop();
   return 0;
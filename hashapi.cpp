@@ -73,7 +73,7 @@ int printGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
 }
 
 int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
-                CommitMessage& noodle) {
+                CommitMessage& noodle, bool hint) {
   if (printGitCommit(thId, sha, b2h, noodle)) {
     return 1;
   }
@@ -131,19 +131,26 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
   }
   com_date = com_date.substr(0, pos + 1);
 
-  std::string parent = noodle.parent;
-  if (!parent.empty()) {
+  // A merge has one parent line per parent.
+  std::vector<std::string> parents;
+  for (pos = 0; pos < noodle.parent.size(); ) {
+    size_t end = noodle.parent.find_first_of("\r\n", pos);
+    if (end == std::string::npos) {
+      end = noodle.parent.size();
+    }
+    std::string parent = noodle.parent.substr(pos, end - pos);
     if (parent.substr(0, 7) != "parent ") {
       fprintf(stderr, "Failed to parse parent: %s\n", parent.c_str());
       return 1;
     }
     parent = parent.substr(7);
-    pos = parent.find_last_not_of("\r\n ");
-    if (pos == std::string::npos) {
+    size_t last = parent.find_last_not_of("\r\n ");
+    if (last == std::string::npos) {
       fprintf(stderr, "Failed to trim parent: %s\n", parent.c_str());
       return 1;
     }
-    parent = parent.substr(0, pos + 1);
+    parents.push_back(parent.substr(0, last + 1));
+    pos = noodle.parent.find_first_not_of("\r\n", end);
   }
 
   std::string tree;
@@ -192,7 +199,9 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
 
   if (0) {
     fprintf(stderr, "tree \"%s\"\n", tree.c_str());
-    if (!parent.empty()) fprintf(stderr, "parent \"%s\"\n", parent.c_str());
+    for (auto& parent : parents) {
+      fprintf(stderr, "parent \"%s\"\n", parent.c_str());
+    }
     fprintf(stderr, "\"%s\" \"%s\" \"%s\"\n",
             author.c_str(), author_email.c_str(), author_date.c_str());
     fprintf(stderr, "\"%s\" \"%s\" \"%s\"\n",
@@ -218,25 +227,34 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
   }
 
   signal(SIGPIPE, handle_SIGPIPE);
-  char* git_argv[] = {
+  std::vector<char*> git_argv{
     (char*)"git", (char*)"commit-tree", (char*)tree.c_str(),
-    NULL,  // Terminate git_argv with a NULL.
-    NULL,
-    NULL,
   };
-  if (!parent.empty()) {
-    git_argv[3] = (char*)"-p";
-    git_argv[4] = (char*)parent.c_str();
+  for (auto& parent : parents) {
+    git_argv.push_back((char*)"-p");
+    git_argv.push_back((char*)parent.c_str());
+  }
+  git_argv.push_back(NULL);  // Terminate git_argv with a NULL.
+  // input is streamed to the child's stdin.
+  std::string input = noodle.log;
+  if (!noodle.extra.empty() || !noodle.nonce.empty()) {
+    // commit-tree cannot write extra headers. Write the raw object instead.
+    git_argv = {
+      (char*)"git", (char*)"hash-object", (char*)"-t", (char*)"commit",
+      (char*)"-w", (char*)"--stdin", NULL,
+    };
+    input.assign(noodle.header.data(), noodle.header.size());
+    input = input.substr(input.find('\0') + 1) + noodle.toRawString();
   }
 
   int pid = fork();
   if (pid < 0) {
-    fprintf(stderr, "fork(git commit-tree) failed: %d %s\n", errno,
+    fprintf(stderr, "fork(git %s) failed: %d %s\n", git_argv.at(1), errno,
             strerror(errno));
     return 1;
   }
   if (!pid) {
-    // In child process: exec(git commit-tree).
+    // In child process: exec(git commit-tree) or exec(git hash-object).
     close(pipe1[0]);  // Close "read end"
     dup2(pipe1[1], 1);  // Redirect stdout to pipe1[1] ("write end")
     dup2(pipe1[1], 2);  // Redirect stderr to pipe1[1] ("write end")
@@ -244,8 +262,8 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
     close(pipe2[1]);  // Close "write end"
     dup2(pipe2[0], 0);  // Redirect pipe2[0] ("read end") to stdin
     close(pipe2[0]);  // Close "read end"
-    execvpe("git", git_argv, git_env.data());
-    fprintf(stderr, "execvpe(git commit-tree) failed: %d %s\n", errno,
+    execvpe("git", git_argv.data(), git_env.data());
+    fprintf(stderr, "execvpe(git %s) failed: %d %s\n", git_argv.at(1), errno,
             strerror(errno));
     fflush(stderr);
     _exit(1);
@@ -292,12 +310,15 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
               events.size());
       return 1;
     } else if (!r) {
-      fprintf(stderr, "Waiting for pid %d: git commit-tree...\n", pid);
+      fprintf(stderr, "Waiting for pid %d: git %s...\n", pid,
+              git_argv.at(1));
       continue;
     }
     for (size_t i = 0; i < (size_t)r; i++) {
       if (events.at(i).data.fd == pipe1[0]) {
-        if (events.at(i).events & EPOLLHUP) {
+        // Read any output that arrived along with the hangup.
+        if ((events.at(i).events & EPOLLHUP) &&
+            !(events.at(i).events & EPOLLIN)) {
           go = 0;
           continue;
         }
@@ -318,18 +339,18 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
         output += s;
       } else if (events.at(i).data.fd == pipe2[1]) {
         // Stream commit message to child process.
-        ssize_t wrlen = write(pipe2[1], noodle.log.c_str() + wrote_count,
-                              noodle.log.size() - wrote_count);
-        if (wrlen != ssize_t(noodle.log.size() - wrote_count)) {
+        ssize_t wrlen = write(pipe2[1], input.c_str() + wrote_count,
+                              input.size() - wrote_count);
+        if (wrlen != ssize_t(input.size() - wrote_count)) {
           fprintf(stderr, "Write failed: %d %s (wrote %lld, want %lld)\n",
                   errno, strerror(errno), (long long) wrlen,
-                  (long long) noodle.log.size() - wrote_count);
+                  (long long) input.size() - wrote_count);
           close(pipe2[1]);
           return 1;
         }
         wrote_count += wrlen;
-        if (wrote_count >= noodle.log.size()) {
-          // All of noodle.log was sent. Close pipe2[1] so child knows.
+        if (wrote_count >= input.size()) {
+          // All of input was sent. Close pipe2[1] so child knows.
           if (epoll_ctl(epollfd, EPOLL_CTL_DEL, pipe2[1], &events.at(i))) {
             fprintf(stderr, "EPOLL_CTL_DEL pipe2 failed: %d %s\n", errno,
                     strerror(errno));
@@ -355,11 +376,84 @@ int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
   }
   snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "\n");
   if (code || output != buf) {
-    fprintf(stderr, "git commit-tree exited with code %d:\n", code);
+    fprintf(stderr, "git %s exited with code %d:\n", git_argv.at(1), code);
     fprintf(stderr, "%s", output.c_str());
     return 1;
   }
-  fprintf(stderr, "repo updated.\n# hint: %s %s",
-          "git checkout master; git reset --hard", buf);
+  if (hint) {
+    fprintf(stderr, "repo updated.\n# hint: %s %s",
+            "git checkout master; git reset --hard", buf);
+  }
+  return 0;
+}
+
+int runGit(const std::vector<std::string>& args, std::string& output) {
+  std::vector<char*> git_argv;
+  git_argv.push_back((char*)"git");
+  for (auto& arg : args) {
+    git_argv.push_back((char*)arg.c_str());
+  }
+  git_argv.push_back(NULL);  // Terminate git_argv with a NULL.
+
+  int pipe1[2];
+  if (pipe(pipe1) < 0) {
+    fprintf(stderr, "pipe(pipe1): %d %s\n", errno, strerror(errno));
+    return 1;
+  }
+  int pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "fork(git %s) failed: %d %s\n", args.at(0).c_str(),
+            errno, strerror(errno));
+    close(pipe1[0]);
+    close(pipe1[1]);
+    return 1;
+  }
+  if (!pid) {
+    // In child process: exec(git). stderr is left alone.
+    close(pipe1[0]);  // Close "read end"
+    dup2(pipe1[1], 1);  // Redirect stdout to pipe1[1] ("write end")
+    close(pipe1[1]);  // Close "write end" since it is now stdout.
+    execvp("git", git_argv.data());
+    fprintf(stderr, "execvp(git %s) failed: %d %s\n", args.at(0).c_str(),
+            errno, strerror(errno));
+    fflush(stderr);
+    _exit(1);
+  }
+  close(pipe1[1]);  // Close "write end" that will not be used in parent
+
+  output.clear();
+  for (;;) {
+    char buf[4096];
+    ssize_t nr = read(pipe1[0], buf, sizeof(buf));
+    if (nr < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "read(git %s) failed: %d %s\n", args.at(0).c_str(),
+              errno, strerror(errno));
+      break;
+    }
+    if (nr == 0) {
+      break;
+    }
+    output.append(buf, nr);
+  }
+  close(pipe1[0]);
+
+  int code;
+  int waitres = waitpid(pid, &code, 0);
+  if (waitres != pid) {
+    fprintf(stderr, "waitpid failed: got %d, want pid %d. %d %s\n",
+            waitres, pid, errno, strerror(errno));
+    return 1;
+  }
+  if (WIFSIGNALED(code)) {
+    fprintf(stderr, "git %s killed by signal %d\n", args.at(0).c_str(),
+            WTERMSIG(code));
+    return 1;
+  }
+  if (!WIFEXITED(code) || WEXITSTATUS(code)) {
+    fprintf(stderr, "git %s exited with code %d\n", args.at(0).c_str(),
+            WIFEXITED(code) ? WEXITSTATUS(code) : code);
+    return 1;
+  }
   return 0;
 }
@@ -120,6 +120,9 @@ public:
   int set(char* message, size_t len) {
     header.clear();
     parent.clear();
+    extra.clear();
+    nonce.clear();
+    nonce_tail.clear();
     type = MessageUNKNOWN;
 
     // Parse message.
@@ -160,12 +163,13 @@ public:
       return 1;
     }
     header.insert(header.end(), message, p);
-    if (!strncmp(p, "parent ", 7)) {
-      char* first = p;
+    // A merge has more than one parent line. parent holds all of them.
+    char* first = p;
+    while (!strncmp(p, "parent ", 7)) {
       p += strcspn(p, "\r\n");
       p += strspn(p, "\r\n");
-      parent.assign(first, p);
     }
+    parent.assign(first, p);
     if (!strncmp(p, "author ", 7)) {
       char* first = p;
       p += strcspn(p, "\r\n");
@@ -176,8 +180,25 @@ public:
     if (!strncmp(p, "committer ", 10)) {
       char* first = p;
       p += strcspn(p, "\r\n");
-      p += strspn(p, "\r\n");
+      size_t nl = strspn(p, "\r\n");
+      p += nl;
       committer.assign(first, p);
+      // A single \n means more headers (encoding, gpgsig, nonce...) follow.
+      // The last one has the extra \n instead of committer.
+      while (nl == 1 && *p) {
+        char* line = p;
+        p += strcspn(p, "\r\n");
+        nl = strspn(p, "\r\n");
+        p += nl;
+        size_t digits = p - nl - line - 6;
+        if (nl != 1 && !strncmp(line, "nonce ", 6) && digits &&
+            strspn(line + 6, "0123456789abcdef") == digits) {
+          nonce.assign(line + 6, digits);
+          nonce_tail.assign(p - nl, p);
+        } else {
+          extra.append(line, p);
+        }
+      }
     } else {
       fprintf(stderr, "CommitMessage: missing committer:\n%s", p);
       return 1;
@@ -225,20 +246,75 @@ public:
   std::string committer;
   std::string committer_time;
   std::string committer_tz;
+  std::string extra;  // Headers after committer, except nonce.
+  std::string nonce;  // Digits of the nonce header, if any.
+  std::string nonce_tail;
   std::string log;
 
   std::string toRawString() const {
-    return parent + author + author_time + author_tz + committer +
-           committer_time + committer_tz + log;
+    std::string s = parent + author + author_time + author_tz + committer +
+                    committer_time + committer_tz + extra;
+    if (!nonce.empty()) {
+      s += "nonce " + nonce + nonce_tail;
+    }
+    return s + log;
+  }
+
+  // set_nonce_width adds a nonce header as the last header, or resets the
+  // one that is there. git ignores the header. The nonce is width zeros.
+  int set_nonce_width(size_t width) {
+    if (!width) {
+      fprintf(stderr, "CommitMessage: nonce width must not be 0\n");
+      return 1;
+    }
+    if (nonce.empty()) {
+      std::string& last = extra.empty() ? committer_tz : extra;
+      size_t pos = last.find_last_not_of("\r\n");
+      if (pos == std::string::npos || pos + 1 == last.size()) {
+        fprintf(stderr, "CommitMessage: no newline before log\n");
+        return 1;
+      }
+      // The newline after the current last header stays, the rest (the
+      // blank line before log) moves after the nonce.
+      nonce_tail = "\n" + last.substr(pos + 2);
+      last.erase(pos + 2);
+    }
+    nonce.assign(width, '0');
+    return updateHeaderLen();
+  }
+
+  // updateHeaderLen fixes the length in header if toRawString() changed size.
+  int updateHeaderLen() {
+    size_t z = 0;
+    while (z < header.size() && header.at(z)) {
+      z++;
+    }
+    if (z >= header.size() || type != MessageCOMMIT) {
+      fprintf(stderr, "CommitMessage: updateHeaderLen: invalid header\n");
+      return 1;
+    }
+    std::vector<char> tree(header.begin() + z + 1, header.end());
+    std::string s = "commit " + std::to_string(tree.size() +
+                                              toRawString().size());
+    header.assign(s.begin(), s.end());
+    header.push_back(0);
+    header.insert(header.end(), tree.begin(), tree.end());
+    return 0;
   }
 
   long long atime() const {
     return author_btime;
   }
 
+  // set_atime and set_ctime also fix the length in header if the time has
+  // a different number of digits.
   void set_atime(long long atime) {
+    size_t was = author_time.size();
     author_btime = atime;
     author_time = std::to_string(atime);
+    if (author_time.size() != was) {
+      (void)updateHeaderLen();
+    }
   }
 
   long long ctime() const {
@@ -246,8 +322,12 @@ public:
   }
 
   void set_ctime(long long ctime) {
+    size_t was = committer_time.size();
     committer_btime = ctime;
     committer_time = std::to_string(ctime);
+    if (committer_time.size() != was) {
+      (void)updateHeaderLen();
+    }
   }
 
   static int parseTimestamp(std::string* packed, std::string* thetime,
@@ -367,5 +447,11 @@ private:
 
 int printGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
                    CommitMessage& noodle);
+// doGitCommit writes noodle to the repo. If hint is true it also prints the
+// command to reset a branch to it.
 int doGitCommit(size_t thId, Sha1Hash& sha, Blake2Hash& b2h,
-                CommitMessage& noodle);
+                CommitMessage& noodle, bool hint = true);
+
+// runGit runs git with args and captures its stdout in output.
+// Returns 1 if git could not be run or exited with an error.
+int runGit(const std::vector<std::string>& args, std::string& output);
@@ -0,0 +1,214 @@
+/* Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ */
+#include "mine-cpu.h"
+
+// digitLimit returns the first time after t that has more digits.
+static long long digitLimit(long long t) {
+  long long limit = 10;
+  while (limit <= t) {
+    limit *= 10;
+  }
+  return limit;
+}
+
+CpuMiner::CpuMiner(const CommitMessage& commit, long long atime_first,
+                   long long ctime_first, size_t wantLen)
+    : commit(commit)
+    , atime_first(atime_first < commit.atime() ? commit.atime() : atime_first)
+    , wantLen(wantLen), t0(Clock::now())
+    , next_ctime(ctime_first < commit.ctime() ? commit.ctime() : ctime_first)
+    {}
+
+CpuMiner::~CpuMiner() {
+  finish();
+}
+
+int CpuMiner::start(size_t n) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!threads.empty()) {
+    fprintf(stderr, "validation: CpuMiner::start called twice\n");
+    return 1;
+  }
+  numThreads = n;
+  startThreads(n);
+  fprintf(stderr, "cpu: %zu threads mining while the GPU starts\n", n);
+  return 0;
+}
+
+void CpuMiner::startThreads(size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    threads.emplace_back(&CpuMiner::worker, this, threads.size() + 1);
+  }
+}
+
+void CpuMiner::finish() {
+  stop = true;
+  std::vector<std::thread> joining;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    joining.swap(threads);
+  }
+  for (auto& th : joining) {
+    th.join();
+  }
+}
+
+long long CpuMiner::gpuAtimeFirst(long long ctime) const {
+  long long first = digitLimit(ctime) / 10;
+  return first < atime_first ? atime_first : first;
+}
+
+void CpuMiner::makeLease(CtimeLease& lease, long long hashes) {
+  lease.id = next_id++;
+  if (split && gpuAtimeFirst(next_ctime) == atime_first) {
+    // The GPU gets every atime up to the next power of ten.
+    next_ctime = digitLimit(next_ctime);
+  }
+  lease.atime_first = atime_first;
+  lease.ctime_first = next_ctime;
+  lease.ctime_end = next_ctime + 1;
+  while (lease.hashCount() < hashes) {
+    lease.ctime_end++;
+  }
+  next_ctime = lease.ctime_end;
+}
+
+int CpuMiner::next(CtimeLease& lease) {
+  if (stopping()) {
+    return 1;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  if (split) {
+    // Stop at the next power of ten, so the kernel fits the whole lease.
+    long long limit = digitLimit(gpu_next_ctime);
+    lease.id = next_id++;
+    lease.atime_first = gpuAtimeFirst(gpu_next_ctime);
+    lease.ctime_first = gpu_next_ctime;
+    lease.ctime_end = gpu_next_ctime + 1;
+    while (lease.ctime_end < limit &&
+           lease.hashCount() < GPU_LEASE_HASHES) {
+      lease.ctime_end++;
+    }
+    gpu_next_ctime = lease.ctime_end;
+    return 0;
+  }
+  if (!gpuStarted) {
+    gpuStarted = true;
+    std::chrono::duration<float> sec = Clock::now() - t0;
+    fprintf(stderr, "cpu: %.3fM hashes in %.1fs, GPU takes over at "
+            "ctime=%lld\n", hashes * 1e-6, sec.count(), next_ctime);
+  }
+  makeLease(lease, GPU_LEASE_HASHES);
+  return 0;
+}
+
+int CpuMiner::heartbeat(long long hashes) {
+  (void)hashes;
+  return stopping();
+}
+
+int CpuMiner::unfinished(const CtimeLease& lease) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (split) {
+    // The GPU's leases end at a power of ten, so it stopped at the start
+    // of one. It gets the lease again after resume().
+    gpu_next_ctime = lease.ctime_first;
+    return 0;
+  }
+  // The GPU had every ctime from here on, so both go back to split.
+  split = lease.ctime_first;
+  gpu_next_ctime = split;
+  next_ctime = split;
+  fprintf(stderr, "cpu: %zu threads mining from ctime=%lld the atimes with "
+          "fewer digits than their ctime, the GPU mines the rest\n",
+          numThreads, split);
+  startThreads(numThreads);
+  return 0;
+}
+
+int CpuMiner::resume(long long& atime, long long& ctime) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!split) {
+    return 1;
+  }
+  atime = gpuAtimeFirst(gpu_next_ctime);
+  ctime = gpu_next_ctime;
+  return 0;
+}
+
+int CpuMiner::reportMatch(long long atime, long long ctime, size_t matchlen) {
+  if (matchlen < wantLen) {
+    return stopping();
+  }
+  CommitMessage noodle(commit);
+  noodle.set_atime(atime);
+  noodle.set_ctime(ctime);
+  return commitMatch(0, noodle);
+}
+
+int CpuMiner::commitMatch(size_t thId, CommitMessage& noodle) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (good) {
+    return 1;  // Only the first match is printed.
+  }
+  // Reproduce the match here: a GPU's claim is not trusted.
+  Sha1Hash sha;
+  Blake2Hash b2h;
+  noodle.hash(sha, b2h);
+  size_t matchlen = 0;
+  if (b2h.instr(sha.result, sizeof(sha.result), &matchlen) == -1 ||
+      matchlen < wantLen) {
+    fprintf(stderr, "Th%zu: atime=%lld ctime=%lld: match %zu < %zu\n", thId,
+            noodle.atime(), noodle.ctime(), matchlen, wantLen);
+    return 0;
+  }
+  if (printGitCommit(thId, sha, b2h, noodle)) {
+    return 0;
+  }
+  good++;
+  return 1;
+}
+
+void CpuMiner::worker(size_t id) {
+  CommitMessage noodle(commit);
+  Sha1Hash sha;
+  Blake2Hash b2h;
+  for (;;) {
+    CtimeLease lease;
+    long long leaseSplit;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      // The threads from start() exit once the GPU starts. The ones started
+      // at the split have higher ids and keep going beside the GPU.
+      if ((gpuStarted && id <= numThreads) || stopping()) {
+        return;
+      }
+      makeLease(lease, CPU_LEASE_HASHES);
+      leaseSplit = split;
+    }
+    for (long long c = lease.ctime_first; c < lease.ctime_end; c++) {
+      noodle.set_ctime(c);
+      long long atime_end = c + 1;
+      if (leaseSplit && c >= leaseSplit) {
+        atime_end = gpuAtimeFirst(c);
+      }
+      for (long long a = lease.atime_first; a < atime_end; a++) {
+        if (stopping()) {
+          return;
+        }
+        noodle.set_atime(a);
+        noodle.hash(sha, b2h);
+        size_t matchlen = 0;
+        if (b2h.instr(sha.result, sizeof(sha.result), &matchlen) != -1 &&
+            matchlen >= wantLen) {
+          CommitMessage match(noodle);
+          if (commitMatch(id, match)) {
+            return;
+          }
+        }
+      }
+      hashes += atime_end - lease.atime_first;
+    }
+  }
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ *
+ * CpuMiner mines on CPU threads while the GPU starts up. Probing devices,
+ * building the kernel and testing it can take many seconds, and a short
+ * search can be over before the GPU is ready.
+ */
+
+#include "hashapi.h"
+#include "mine-lease.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+// CpuMiner hands out the search space in order, starting at (atime_first,
+// ctime_first). Its threads take small leases until the GPU's first call to
+// next(). After that they finish the lease they have and exit, and the GPU
+// gets big leases that carry on where they stopped. The first match of at
+// least wantLen bytes, from either one, is printed and stops both.
+//
+// The GPU's kernel only handles times with the digit count it was built for.
+// Once the GPU hands back work where the ctimes gained a digit, every pair
+// from there on goes to one of two places. The GPU gets pairs where the atime
+// has as many digits as the ctime, and resume() tells it where to rebuild
+// its kernel. The threads start again and take pairs where the atime has
+// fewer digits.
+class CpuMiner : public LeaseSource {
+public:
+  CpuMiner(const CommitMessage& commit, long long atime_first,
+           long long ctime_first, size_t wantLen);
+  virtual ~CpuMiner();
+
+  // start runs n mining threads.
+  int start(size_t n);
+
+  // finish stops the threads and waits for them.
+  void finish();
+
+  // found returns true once a match is printed.
+  bool found() const { return good; }
+
+  int next(CtimeLease& lease) override;
+  int heartbeat(long long hashes) override;
+  int reportMatch(long long atime, long long ctime, size_t matchlen) override;
+  int unfinished(const CtimeLease& lease) override;
+  int resume(long long& atime, long long& ctime) override;
+  bool stopping() override { return good || stop; }
+
+  // A CPU lease is about a second of work for one thread, so the GPU never
+  // runs long beside a thread that is still finishing one.
+  static const long long CPU_LEASE_HASHES = 1LL << 20;
+  // A GPU lease is many batches, so leases rarely cut a batch short.
+  static const long long GPU_LEASE_HASHES = 1LL << 34;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  void worker(size_t id);
+  // startThreads runs n mining threads. mutex must be locked.
+  void startThreads(size_t n);
+  // makeLease outputs the next lease of at least hashes pairs for the
+  // threads. mutex must be locked.
+  void makeLease(CtimeLease& lease, long long hashes);
+  // gpuAtimeFirst returns the first atime the GPU gets for ctime once the
+  // work is split. The threads get the atimes before it.
+  long long gpuAtimeFirst(long long ctime) const;
+  // commitMatch verifies the match in noodle and prints it with
+  // printGitCommit if it is the first one. Returns 1 if mining should stop.
+  int commitMatch(size_t thId, CommitMessage& noodle);
+
+  const CommitMessage& commit;
+  const long long atime_first;
+  const size_t wantLen;
+  const Clock::time_point t0;
+
+  std::mutex mutex;  // Guards the members below, up to the atomics.
+  long long next_ctime;
+  unsigned long long next_id{1};
+  bool gpuStarted{false};
+  size_t numThreads{0};  // From start().
+  long long split{0};  // The work is split from this ctime on, if not 0.
+  long long gpu_next_ctime{0};  // Where the GPU carries on after split.
+  std::vector<std::thread> threads;
+
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> good{0};
+  std::atomic<long long> hashes{0};  // Pairs hashed by the CPU threads.
+};
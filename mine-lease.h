@@ -0,0 +1,120 @@
+/* Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ *
+ * A CtimeLease is a slice of the search space. LeaseSource hands them out so
+ * that more than one miner (threads, a GPU, or other hosts) can split the
+ * search without overlap.
+ */
+
+#include <stddef.h>
+#include <mutex>
+
+#pragma once
+
+// CtimeLease is every committer time in [ctime_first, ctime_end), each paired
+// with every author time from atime_first up to and including that committer
+// time.
+struct CtimeLease {
+  unsigned long long id{0};
+  long long atime_first{0};
+  long long ctime_first{0};
+  long long ctime_end{0};
+
+  // hashCount returns the number of (atime, ctime) pairs in the lease: each
+  // ctime has every atime from atime_first up to and including itself.
+  long long hashCount() const {
+    long long n = ctime_end - ctime_first;
+    return n * (ctime_first - atime_first + 1) + n * (n - 1) / 2;
+  }
+};
+
+// LeaseSource is the interface a miner uses to get work and report progress.
+// All methods may be called from any thread.
+class LeaseSource {
+public:
+  virtual ~LeaseSource() {}
+
+  // next returns 0 and fills in lease, or returns 1 if mining should stop.
+  virtual int next(CtimeLease& lease) = 0;
+
+  // done reports that every hash in lease has been checked.
+  virtual int done(const CtimeLease& lease) {
+    (void)lease;
+    return 0;
+  }
+
+  // heartbeat reports the total number of hashes checked so far.
+  // Returns 1 if mining should stop.
+  virtual int heartbeat(long long hashes) {
+    (void)hashes;
+    return 0;
+  }
+
+  // reportMatch reports a match of matchlen bytes. If matchlen is less than
+  // the target this is just a progress report. Returns 1 if mining should
+  // stop.
+  virtual int reportMatch(long long atime, long long ctime, size_t matchlen) {
+    (void)atime;
+    (void)ctime;
+    (void)matchlen;
+    return 0;
+  }
+
+  // unfinished hands back the part of a lease, from its ctime_first on, that
+  // the miner will not search. A source that hands out again every lease
+  // not reported done can ignore it.
+  virtual int unfinished(const CtimeLease& lease) {
+    (void)lease;
+    return 0;
+  }
+
+  // resume is for a miner that handed work back with unfinished() because
+  // its times gained a digit. It outputs the times next() starts at from
+  // then on. Every lease after that has all its times, atimes and ctimes,
+  // at one digit count. Returns 1 if the source cannot split its work that
+  // way, and the miner should stop.
+  virtual int resume(long long& atime, long long& ctime) {
+    (void)atime;
+    (void)ctime;
+    return 1;
+  }
+
+  // matchLen returns the match length that ends the search, or 0 if the
+  // miner should use its own.
+  virtual size_t matchLen() {
+    return 0;
+  }
+
+  // stopping returns true once mining should stop. Unlike the other methods
+  // it never blocks, so it can be polled between slow setup steps.
+  virtual bool stopping() {
+    return false;
+  }
+};
+
+// LocalLeaseSource hands out consecutive leases of leaseLen ctimes, starting
+// at ctime_first. It never runs out.
+class LocalLeaseSource : public LeaseSource {
+public:
+  LocalLeaseSource(long long atime_first, long long ctime_first,
+                   long long leaseLen = 1024)
+      : atime_first(atime_first), next_ctime(ctime_first)
+      , leaseLen(leaseLen) {}
+
+  int next(CtimeLease& lease) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    lease.id = next_id++;
+    lease.atime_first = atime_first;
+    lease.ctime_first = next_ctime;
+    next_ctime += leaseLen;
+    lease.ctime_end = next_ctime;
+    return 0;
+  }
+
+protected:
+  std::mutex mutex;
+  const long long atime_first;
+  long long next_ctime;
+  const long long leaseLen;
+  unsigned long long next_id{1};
+};
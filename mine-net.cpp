@@ -0,0 +1,524 @@
+/* Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ */
+#include "mine-net.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static int sendAll(int fd, const char* buf, size_t len) {
+  while (len) {
+    ssize_t r = send(fd, buf, len, MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "send failed: %d %s\n", errno, strerror(errno));
+      return 1;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
+}
+
+RemoteLeaseSource::~RemoteLeaseSource() {
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+int RemoteLeaseSource::open(const char* hostport, CommitMessage* out) {
+  std::string host = hostport;
+  size_t pos = host.rfind(":");
+  if (pos == std::string::npos) {
+    fprintf(stderr, "%s: want host:port, got \"%s\"\n", whoami, hostport);
+    return 1;
+  }
+  std::string port = host.substr(pos + 1);
+  host = host.substr(0, pos);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = NULL;
+  int r = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+  if (r) {
+    fprintf(stderr, "%s: getaddrinfo(%s): %s\n", whoami, hostport,
+            gai_strerror(r));
+    return 1;
+  }
+  for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    fprintf(stderr, "%s: connect(%s) failed: %d %s\n", whoami, hostport, errno,
+            strerror(errno));
+    return 1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // The coordinator replies right away, so a long silence means it is gone.
+  struct timeval tv;
+  memset(&tv, 0, sizeof(tv));
+  tv.tv_sec = REPLY_TIMEOUT_SEC;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+    fprintf(stderr, "%s: setsockopt(SO_RCVTIMEO) failed: %d %s\n", whoami,
+            errno, strerror(errno));
+    return 1;
+  }
+
+  char hostname[256];
+  if (gethostname(hostname, sizeof(hostname))) {
+    snprintf(hostname, sizeof(hostname), "unknown");
+  }
+  hostname[sizeof(hostname) - 1] = 0;
+  char buf[512];
+  snprintf(buf, sizeof(buf), "HELLO %s/%d", hostname, (int)getpid());
+  std::string reply;
+  if (call(buf, reply)) {
+    return 1;
+  }
+  size_t len;
+  int n;
+  if (sscanf(reply.c_str(), "COMMIT %zu %zu%n", &len, &wantLen, &n) != 2 ||
+      (size_t)n != reply.size() || !wantLen) {
+    fprintf(stderr, "%s: coordinator said \"%s\", want COMMIT\n", whoami,
+            reply.c_str());
+    return 1;
+  }
+  std::vector<char> message(len + 1);
+  if (readBytes(message.data(), len)) {
+    return 1;
+  }
+  message.at(len) = 0;
+  return out->set(message.data(), len);
+}
+
+int RemoteLeaseSource::readLine(std::string& line) {
+  for (;;) {
+    size_t pos = inbuf.find("\n");
+    if (pos != std::string::npos) {
+      line = inbuf.substr(0, pos);
+      inbuf.erase(0, pos + 1);
+      return 0;
+    }
+    char buf[256];
+    ssize_t r = recv(fd, buf, sizeof(buf), 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      return lostCoordinator(r);
+    }
+    inbuf.append(buf, r);
+  }
+}
+
+int RemoteLeaseSource::lostCoordinator(ssize_t r) {
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    fprintf(stderr, "%s: lost coordinator: no reply in %ds\n", whoami,
+            (int)REPLY_TIMEOUT_SEC);
+  } else {
+    fprintf(stderr, "%s: lost coordinator: %s\n", whoami,
+            r ? strerror(errno) : "closed");
+  }
+  return 1;
+}
+
+int RemoteLeaseSource::readBytes(char* buf, size_t len) {
+  size_t have = inbuf.size() < len ? inbuf.size() : len;
+  memcpy(buf, inbuf.data(), have);
+  inbuf.erase(0, have);
+  while (have < len) {
+    ssize_t r = recv(fd, buf + have, len - have, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      return lostCoordinator(r);
+    }
+    have += r;
+  }
+  return 0;
+}
+
+int RemoteLeaseSource::call(const std::string& request, std::string& reply) {
+  if (fd < 0 || stopped) {
+    return 1;
+  }
+  std::string line = request + "\n";
+  if (sendAll(fd, line.c_str(), line.size()) || readLine(reply)) {
+    stopped = true;
+    return 1;
+  }
+  if (reply == "STOP") {
+    stopped = true;
+    return 1;
+  }
+  return 0;
+}
+
+int RemoteLeaseSource::next(CtimeLease& lease) {
+  std::unique_lock<std::mutex> lock(mutex);
+  std::string reply;
+  if (call("LEASE", reply)) {
+    return 1;
+  }
+  int n;
+  if (sscanf(reply.c_str(), "LEASE %llu %lld %lld %lld%n", &lease.id,
+             &lease.atime_first, &lease.ctime_first, &lease.ctime_end,
+             &n) != 4 || (size_t)n != reply.size()) {
+    fprintf(stderr, "%s: coordinator said \"%s\", want LEASE\n", whoami,
+            reply.c_str());
+    stopped = true;
+    return 1;
+  }
+  return 0;
+}
+
+int RemoteLeaseSource::done(const CtimeLease& lease) {
+  std::unique_lock<std::mutex> lock(mutex);
+  std::string reply;
+  return call("DONE " + std::to_string(lease.id), reply);
+}
+
+int RemoteLeaseSource::heartbeat(long long hashes) {
+  std::unique_lock<std::mutex> lock(mutex);
+  std::string reply;
+  return call("HEARTBEAT " + std::to_string(hashes), reply);
+}
+
+int RemoteLeaseSource::reportMatch(long long atime, long long ctime,
+                                   size_t matchlen) {
+  std::unique_lock<std::mutex> lock(mutex);
+  std::string reply;
+  return call("MATCH " + std::to_string(atime) + " " + std::to_string(ctime) +
+              " " + std::to_string(matchlen), reply);
+}
+
+MineCoordinator::~MineCoordinator() {
+  for (auto& w : workers) {
+    close(w.first);
+  }
+  if (listenfd != -1) {
+    close(listenfd);
+    listenfd = -1;
+  }
+}
+
+int MineCoordinator::listen(int port) {
+  listenfd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (listenfd < 0) {
+    fprintf(stderr, "socket failed: %d %s\n", errno, strerror(errno));
+    return 1;
+  }
+  int one = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  int zero = 0;
+  // Accept IPv4 connections too.
+  setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (bind(listenfd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr))) {
+    fprintf(stderr, "bind(%d) failed: %d %s\n", port, errno, strerror(errno));
+    return 1;
+  }
+  if (::listen(listenfd, 64)) {
+    fprintf(stderr, "listen(%d) failed: %d %s\n", port, errno,
+            strerror(errno));
+    return 1;
+  }
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+  fprintf(stderr, "coordinator: listening on port %d\n", port);
+  return 0;
+}
+
+void MineCoordinator::makeLease(CtimeLease& lease) {
+  if (!returned.empty()) {
+    lease = returned.front();
+    returned.pop_front();
+  } else {
+    lease.atime_first = atime_first;
+    lease.ctime_first = next_ctime;
+    lease.ctime_end = next_ctime + 1;
+    while (lease.hashCount() < LEASE_HASHES) {
+      lease.ctime_end++;
+    }
+    next_ctime = lease.ctime_end;
+  }
+  // A fresh id means a late DONE for an expired lease is ignored.
+  lease.id = next_id++;
+}
+
+int MineCoordinator::acceptWorker() {
+  for (;;) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+      }
+      fprintf(stderr, "accept failed: %d %s\n", errno, strerror(errno));
+      return 1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    workers[fd].name = "fd" + std::to_string(fd);
+  }
+}
+
+void MineCoordinator::dropWorker(int fd) {
+  auto wi = workers.find(fd);
+  if (wi == workers.end()) {
+    return;
+  }
+  gone_hashes += wi->second.hashes;
+  for (auto i = outstanding.begin(); i != outstanding.end(); ) {
+    if (i->second.fd == fd) {
+      if (!stopping) {
+        fprintf(stderr, "coordinator: %s left, reassigning lease %llu\n",
+                wi->second.name.c_str(), i->first);
+      }
+      returned.push_back(i->second.lease);
+      i = outstanding.erase(i);
+    } else {
+      i++;
+    }
+  }
+  close(fd);
+  workers.erase(wi);
+}
+
+void MineCoordinator::expireLeases(Clock::time_point now) {
+  for (auto i = outstanding.begin(); i != outstanding.end(); ) {
+    if (i->second.expires < now) {
+      fprintf(stderr, "coordinator: lease %llu expired, reassigning\n",
+              i->first);
+      returned.push_back(i->second.lease);
+      i = outstanding.erase(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void MineCoordinator::handleMatch(Worker& w, long long atime, long long ctime,
+                                  size_t matchlen) {
+  if (atime < atime_first || atime > ctime || ctime < commit.ctime()) {
+    fprintf(stderr, "coordinator: %s: bogus match atime=%lld ctime=%lld\n",
+            w.name.c_str(), atime, ctime);
+    return;
+  }
+  // Verify the worker's claim before trusting it.
+  CommitMessage noodle(commit);
+  noodle.set_atime(atime);
+  noodle.set_ctime(ctime);
+  Sha1Hash sha;
+  Blake2Hash b2h;
+  noodle.hash(sha, b2h);
+  size_t verified = 0;
+  b2h.instr(sha.result, sizeof(sha.result), &verified);
+  if (verified != matchlen) {
+    fprintf(stderr, "coordinator: %s: claimed match %zu, verified %zu\n",
+            w.name.c_str(), matchlen, verified);
+  }
+  if (verified > best) {
+    best = verified;
+    fprintf(stderr, "coordinator: %s: best:%zu atime=%lld ctime=%lld\n",
+            w.name.c_str(), best, atime, ctime);
+  }
+  if (verified >= wantLen && !stopping) {
+    if (doGitCommit(0, sha, b2h, noodle)) {
+      fprintf(stderr, "coordinator: doGitCommit failed\n");
+    }
+    stopping = true;
+    stop_t = Clock::now();
+  }
+}
+
+int MineCoordinator::handleLine(int fd, Worker& w, const std::string& line) {
+  auto now = Clock::now();
+  std::string reply = "OK";
+  long long a, c;
+  unsigned long long id;
+  size_t len;
+  int n = 0;
+  if (!strncmp(line.c_str(), "HELLO ", 6)) {
+    w.name = line.substr(6);
+    fprintf(stderr, "coordinator: %s joined\n", w.name.c_str());
+    std::string s = commit.toRawString();
+    reply = "COMMIT " + std::to_string(commit.header.size() + s.size()) +
+            " " + std::to_string(wantLen) + "\n";
+    w.out += reply;
+    w.out.append(commit.header.data(), commit.header.size());
+    w.out += s;
+    return 0;
+  } else if (line == "LEASE") {
+    if (!stopping) {
+      Outstanding o;
+      makeLease(o.lease);
+      o.fd = fd;
+      o.expires = now + std::chrono::seconds(LEASE_TIMEOUT_SEC);
+      outstanding[o.lease.id] = o;
+      reply = "LEASE " + std::to_string(o.lease.id) + " " +
+              std::to_string(o.lease.atime_first) + " " +
+              std::to_string(o.lease.ctime_first) + " " +
+              std::to_string(o.lease.ctime_end);
+    }
+  } else if (sscanf(line.c_str(), "DONE %llu%n", &id, &n) == 1 &&
+             (size_t)n == line.size()) {
+    auto i = outstanding.find(id);
+    if (i != outstanding.end() && i->second.fd == fd) {
+      outstanding.erase(i);
+    }
+  } else if (sscanf(line.c_str(), "HEARTBEAT %lld%n", &a, &n) == 1 &&
+             (size_t)n == line.size()) {
+    w.hashes = a;
+    for (auto& o : outstanding) {
+      if (o.second.fd == fd) {
+        o.second.expires = now + std::chrono::seconds(LEASE_TIMEOUT_SEC);
+      }
+    }
+  } else if (sscanf(line.c_str(), "MATCH %lld %lld %zu%n", &a, &c, &len,
+                    &n) == 3 && (size_t)n == line.size()) {
+    handleMatch(w, a, c, len);
+  } else {
+    fprintf(stderr, "coordinator: %s: invalid request \"%s\"\n",
+            w.name.c_str(), line.c_str());
+    return 1;
+  }
+  if (stopping) {
+    reply = "STOP";
+  }
+  w.out += reply + "\n";
+  return 0;
+}
+
+int MineCoordinator::readWorker(int fd) {
+  Worker& w = workers.at(fd);
+  char buf[4096];
+  ssize_t r = recv(fd, buf, sizeof(buf), 0);
+  if (r < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    return 1;
+  }
+  if (r == 0) {
+    return 1;
+  }
+  w.in.append(buf, r);
+  for (size_t pos; (pos = w.in.find("\n")) != std::string::npos; ) {
+    std::string line = w.in.substr(0, pos);
+    w.in.erase(0, pos + 1);
+    if (handleLine(fd, w, line)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int MineCoordinator::writeWorker(int fd) {
+  Worker& w = workers.at(fd);
+  while (!w.out.empty()) {
+    ssize_t r = send(fd, w.out.data(), w.out.size(), MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+      }
+      return 1;
+    }
+    w.out.erase(0, r);
+  }
+  return 0;
+}
+
+void MineCoordinator::printProgress(Clock::time_point now) {
+  long long total = gone_hashes;
+  for (auto& w : workers) {
+    total += w.second.hashes;
+  }
+  std::chrono::duration<float> elapsed_sec = now - start_t;
+  std::chrono::duration<float> sec = now - last_print;
+  fprintf(stderr, "%4.1fs %zu workers %zu leases %8.2f MHash/s  best:%zu  "
+          "ctime<%lld\n", elapsed_sec.count(), workers.size(),
+          outstanding.size(), float(total - last_hashes) / sec.count() / 1e6,
+          best, next_ctime);
+  last_hashes = total;
+  last_print = now;
+}
+
+int MineCoordinator::run() {
+  if (listenfd < 0) {
+    fprintf(stderr, "BUG: must call listen() before run()\n");
+    return 1;
+  }
+  start_t = Clock::now();
+  last_print = start_t;
+  for (;;) {
+    std::vector<struct pollfd> fds;
+    fds.emplace_back();
+    fds.back().fd = listenfd;
+    fds.back().events = POLLIN;
+    for (auto& w : workers) {
+      fds.emplace_back();
+      fds.back().fd = w.first;
+      fds.back().events = POLLIN | (w.second.out.empty() ? 0 : POLLOUT);
+    }
+    int r = poll(fds.data(), fds.size(), 250 /*milliseconds*/);
+    if (r < 0 && errno != EINTR) {
+      fprintf(stderr, "poll failed: %d %s\n", errno, strerror(errno));
+      return 1;
+    }
+    for (size_t i = 0; r > 0 && i < fds.size(); i++) {
+      if (!fds.at(i).revents) {
+        continue;
+      }
+      int fd = fds.at(i).fd;
+      if (fd == listenfd) {
+        if (acceptWorker()) {
+          return 1;
+        }
+        continue;
+      }
+      if (((fds.at(i).revents & (POLLIN | POLLHUP | POLLERR)) &&
+           readWorker(fd)) ||
+          ((fds.at(i).revents & POLLOUT) && writeWorker(fd))) {
+        dropWorker(fd);
+        continue;
+      }
+      // Send any reply right away instead of waiting for the next poll.
+      if (writeWorker(fd)) {
+        dropWorker(fd);
+      }
+    }
+
+    auto now = Clock::now();
+    expireLeases(now);
+    if (now - last_print >= std::chrono::seconds(1)) {
+      printProgress(now);
+    }
+    if (stopping && (workers.empty() ||
+                     now - stop_t > std::chrono::seconds(STOP_GRACE_SEC))) {
+      return 0;
+    }
+  }
+}
@@ -0,0 +1,140 @@
+/* Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ *
+ * Distributed mining: a coordinator owns the (atime, ctime) search space for
+ * one commit and leases ctime ranges to workers over TCP.
+ *
+ * The protocol is line-based text. Every request from a worker gets exactly
+ * one reply, so a worker never has to handle unsolicited messages:
+ *
+ *   HELLO <name>                 -> COMMIT <len> <matchlen>\n followed by
+ *                                   <len> bytes. matchlen ends the search.
+ *   LEASE                        -> LEASE <id> <atime> <ctime> <ctime_end>
+ *   DONE <id>                    -> OK
+ *   HEARTBEAT <hashes>           -> OK
+ *   MATCH <atime> <ctime> <len>  -> OK
+ *
+ * Any reply may instead be STOP, which means the search is over.
+ */
+
+#include "hashapi.h"
+#include "mine-lease.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#pragma once
+
+// RemoteLeaseSource is the worker side: it gets leases from a coordinator.
+class RemoteLeaseSource : public LeaseSource {
+public:
+  RemoteLeaseSource(const char* whoami) : whoami(whoami) {}
+  virtual ~RemoteLeaseSource();
+
+  // open connects to hostport ("host:port") and receives the commit to mine.
+  int open(const char* hostport, CommitMessage* out);
+
+  int next(CtimeLease& lease) override;
+  int done(const CtimeLease& lease) override;
+  int heartbeat(long long hashes) override;
+  int reportMatch(long long atime, long long ctime, size_t matchlen) override;
+  size_t matchLen() override { return wantLen; }
+  bool stopping() override { return stopped; }
+
+  enum {
+    // Give up on the coordinator if a reply takes this long.
+    REPLY_TIMEOUT_SEC = 30,
+  };
+
+private:
+  // call sends request and reads the one-line reply. Returns 1 on error.
+  // Sets stopped if the reply is STOP.
+  int call(const std::string& request, std::string& reply);
+  int readLine(std::string& line);
+  int readBytes(char* buf, size_t len);
+  // lostCoordinator prints why recv returned r, and returns 1.
+  int lostCoordinator(ssize_t r);
+
+  const char* const whoami;
+  std::mutex mutex;
+  int fd{-1};
+  size_t wantLen{0};  // From the coordinator's COMMIT reply.
+  std::atomic<bool> stopped{false};
+  std::string inbuf;
+};
+
+// MineCoordinator serves leases to workers until one of them reports a match
+// of at least wantLen bytes. It verifies the match and commits it.
+class MineCoordinator {
+public:
+  MineCoordinator(const CommitMessage& commit, long long atime_first,
+                  long long ctime_first, size_t wantLen)
+      : commit(commit), atime_first(atime_first), next_ctime(ctime_first)
+      , wantLen(wantLen) {}
+  virtual ~MineCoordinator();
+
+  // listen opens a TCP socket on port.
+  int listen(int port);
+
+  // run serves workers until a match is committed.
+  int run();
+
+  enum {
+    // A lease is sized so it has about this many hashes.
+    LEASE_HASHES = 256*1024*1024,
+    // A lease is reassigned if its worker is silent this long.
+    LEASE_TIMEOUT_SEC = 30,
+    // After a match, wait this long for workers to hear STOP.
+    STOP_GRACE_SEC = 3,
+  };
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Worker {
+    std::string name;
+    std::string in;
+    std::string out;
+    long long hashes{0};
+  };
+
+  struct Outstanding {
+    CtimeLease lease;
+    int fd;
+    Clock::time_point expires;
+  };
+
+  int acceptWorker();
+  int readWorker(int fd);
+  int writeWorker(int fd);
+  void dropWorker(int fd);
+  int handleLine(int fd, Worker& w, const std::string& line);
+  void makeLease(CtimeLease& lease);
+  void handleMatch(Worker& w, long long atime, long long ctime,
+                   size_t matchlen);
+  void expireLeases(Clock::time_point now);
+  void printProgress(Clock::time_point now);
+
+  const CommitMessage& commit;
+  const long long atime_first;
+  long long next_ctime;
+  const size_t wantLen;
+
+  int listenfd{-1};
+  std::map<int, Worker> workers;
+  std::map<unsigned long long, Outstanding> outstanding;
+  std::deque<CtimeLease> returned;
+  unsigned long long next_id{1};
+  long long gone_hashes{0};  // Hashes from workers that disconnected.
+  long long last_hashes{0};
+  size_t best{0};
+  bool stopping{false};
+  Clock::time_point start_t;
+  Clock::time_point last_print;
+  Clock::time_point stop_t;
+};
@@ -159,7 +159,8 @@ int OpenCLdev::probe() {
       getDeviceInfo(devId, CL_DEVICE_LOCAL_MEM_SIZE, info.localMemSize) ||
       getDeviceInfo(devId, CL_DEVICE_MAX_COMPUTE_UNITS, info.maxCU) ||
       getDeviceInfo(devId, CL_DEVICE_MAX_WORK_GROUP_SIZE, info.maxWG) ||
-      getDeviceInfo(devId, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, info.maxWI)) {
+      getDeviceInfo(devId, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, info.maxWI) ||
+      getDeviceInfo(devId, CL_DEVICE_HOST_UNIFIED_MEMORY, info.hostUnified)) {
     return 1;
   }
   if (getDeviceInfo(devId, CL_DEVICE_NAME, info.name) ||
@@ -87,6 +87,7 @@ public:
     cl_uint maxCU;
     size_t maxWG;
     cl_uint maxWI;
+    cl_bool hostUnified;  // The device shares memory with the host.
     std::string name;
     std::string vendor;
     std::string openclver;
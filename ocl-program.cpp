@@ -1,7 +1,18 @@
 #include "ocl-program.h"
+#include "hashapi.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
 
 namespace gitmine {
 
+// PROGRAM_CACHE_MAX is how many program binaries the cache keeps. Most
+// commits have a layout of their own (see getKernelDefines), so the cache
+// only saves a build when a layout is mined again.
+#define PROGRAM_CACHE_MAX ((size_t)32)
+
 int OpenCLmem::create(cl_mem_flags flags, size_t size) {
   if (handle) {
     fprintf(stderr, "validation: OpenCLmem::create called twice\n");
@@ -30,36 +41,208 @@ static int printBuildLog(char* log) {
   return 0;
 }
 
-int OpenCLprog::open(const char* mainFuncName, std::string buildargs /*= ""*/) {
-  if (prog) {
-    fprintf(stderr, "validation: OpenCLprog::open called twice\n");
+std::string getCacheDir() {
+  std::string dir;
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (xdg && *xdg) {
+    dir = xdg;
+  } else if (home && *home) {
+    dir = std::string(home) + "/.cache";
+  } else {
+    return "";
+  }
+  mkdir(dir.c_str(), 0700);
+  dir += "/git-mine";
+  if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+    return "";
+  }
+  return dir;
+}
+
+// getCachePath returns the file in getCacheDir() for a program built from
+// code with buildargs on dev. It returns "" if there is no cache directory.
+static std::string getCachePath(const char* code, const std::string& buildargs,
+                                OpenCLdev& dev) {
+  std::string dir = getCacheDir();
+  if (dir.empty()) {
+    return "";
+  }
+
+  // The key covers everything that can change the binary.
+  Sha1Hash key;
+  const std::string* parts[] = {
+    &buildargs, &dev.info.name, &dev.info.vendor, &dev.info.openclver,
+    &dev.info.driver,
+  };
+  key.update(code, strlen(code) + 1);
+  for (auto part : parts) {
+    key.update(part->c_str(), part->size() + 1);
+  }
+  key.flush();
+  char hex[SHA_DIGEST_LENGTH*2 + 1];
+  if (key.dump(hex, sizeof(hex))) {
+    return "";
+  }
+  return dir + "/" + hex + ".bin";
+}
+
+// pruneCache deletes the least recently used binaries in dir until
+// PROGRAM_CACHE_MAX are left. loadBinary touches each binary it uses.
+static void pruneCache(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return;
+  }
+  std::vector<std::pair<time_t, std::string>> bins;
+  for (struct dirent* e; (e = readdir(d)) != NULL; ) {
+    std::string name = e->d_name;
+    if (name.size() < 4 || name.compare(name.size() - 4, 4, ".bin")) {
+      continue;
+    }
+    std::string path = dir + "/" + name;
+    struct stat st;
+    if (!stat(path.c_str(), &st)) {
+      bins.emplace_back(st.st_mtime, path);
+    }
+  }
+  closedir(d);
+  if (bins.size() <= PROGRAM_CACHE_MAX) {
+    return;
+  }
+  std::sort(bins.begin(), bins.end());
+  for (size_t i = 0; i + PROGRAM_CACHE_MAX < bins.size(); i++) {
+    (void)unlink(bins.at(i).second.c_str());
+  }
+}
+
+// loadBinary builds prog from a binary saved by saveBinary. Any failure
+// just means the source must be compiled.
+int OpenCLprog::loadBinary(const std::string& path,
+                           const std::string& buildargs) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) {
     return 1;
   }
-  funcName = mainFuncName;
-  const char* pCode = code;
+  std::vector<unsigned char> bin;
+  unsigned char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    bin.insert(bin.end(), buf, buf + n);
+  }
+  fclose(f);
+  if (bin.empty()) {
+    return 1;
+  }
+
+  const unsigned char* pBin = bin.data();
+  size_t len = bin.size();
+  cl_int status;
   cl_int v;
-  prog = clCreateProgramWithSource(dev.getContext(), 1, &pCode, NULL, &v);
+  prog = clCreateProgramWithBinary(dev.getContext(), 1, &dev.devId, &len,
+                                   &pBin, &status, &v);
+  if (v == CL_SUCCESS && status == CL_SUCCESS) {
+    v = clBuildProgram(prog, 1, &dev.devId, buildargs.c_str(), NULL, NULL);
+    if (v == CL_SUCCESS) {
+      (void)utime(path.c_str(), NULL);  // Mark it used for pruneCache.
+      return 0;
+    }
+  }
+  fprintf(stderr, "%s: stale program binary, rebuilding\n", path.c_str());
+  if (prog) {
+    clReleaseProgram(prog);
+    prog = NULL;
+  }
+  return 1;
+}
+
+// saveBinary writes the CL_PROGRAM_BINARIES of prog to path. The file is
+// renamed into place, so a concurrent run never sees a partial binary.
+int OpenCLprog::saveBinary(const std::string& path) {
+  size_t len = 0;
+  cl_int v = clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(len),
+                              &len, NULL);
+  if (v != CL_SUCCESS || !len) {
+    fprintf(stderr, "%s failed: %d %s\n", "clGetProgramInfo", v, clerrstr(v));
+    return 1;
+  }
+  std::vector<unsigned char> bin(len);
+  unsigned char* pBin = bin.data();
+  v = clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(pBin), &pBin, NULL);
   if (v != CL_SUCCESS) {
-    fprintf(stderr, "%s failed: %d %s\n", "clCreateProgramWithSource", v,
-            clerrstr(v));
+    fprintf(stderr, "%s failed: %d %s\n", "clGetProgramInfo", v, clerrstr(v));
     return 1;
   }
 
-  v = clBuildProgram(prog, 1, &dev.devId, buildargs.c_str(), NULL, NULL);
-  if (v != CL_SUCCESS) {
-    fprintf(stderr, "%s failed: %d %s\n", "clBuildProgram", v, clerrstr(v));
-    (void)printBuildLog(getBuildLog());
+  std::string tmp = path + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "fopen(%s): %d %s\n", tmp.c_str(), errno, strerror(errno));
     return 1;
   }
-  if (printBuildLog(getBuildLog())) {
+  if (fwrite(bin.data(), 1, bin.size(), f) != bin.size() || fclose(f)) {
+    fprintf(stderr, "write %s: %d %s\n", tmp.c_str(), errno, strerror(errno));
+    unlink(tmp.c_str());
+    return 1;
+  }
+  if (rename(tmp.c_str(), path.c_str())) {
+    fprintf(stderr, "rename(%s): %d %s\n", path.c_str(), errno,
+            strerror(errno));
+    unlink(tmp.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int OpenCLprog::open(const char* mainFuncName, std::string buildargs /*= ""*/) {
+  if (prog) {
+    fprintf(stderr, "validation: OpenCLprog::open called twice\n");
     return 1;
   }
+  funcName = mainFuncName;
+  cl_int v;
+  std::string cachePath = getCachePath(code, buildargs, dev);
+  if (cachePath.empty() || loadBinary(cachePath, buildargs)) {
+    const char* pCode = code;
+    prog = clCreateProgramWithSource(dev.getContext(), 1, &pCode, NULL, &v);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clCreateProgramWithSource", v,
+              clerrstr(v));
+      return 1;
+    }
+
+    v = clBuildProgram(prog, 1, &dev.devId, buildargs.c_str(), NULL, NULL);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clBuildProgram", v, clerrstr(v));
+      (void)printBuildLog(getBuildLog());
+      return 1;
+    }
+    if (printBuildLog(getBuildLog())) {
+      return 1;
+    }
+    if (!cachePath.empty()) {
+      // A program that cannot be cached still works.
+      if (!saveBinary(cachePath)) {
+        pruneCache(getCacheDir());
+      }
+    }
+  }
 
   kern = clCreateKernel(prog, mainFuncName, &v);
   if (v != CL_SUCCESS) {
     fprintf(stderr, "%s failed: %d %s\n", "clCreateKernel", v, clerrstr(v));
     return 1;
   }
+  size_t reqd[3] = { 0, 0, 0 };
+  v = clGetKernelWorkGroupInfo(kern, dev.devId,
+                               CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                               sizeof(reqd), reqd, NULL);
+  if (v != CL_SUCCESS) {
+    fprintf(stderr, "%s failed: %d %s\n", "clGetKernelWorkGroupInfo", v,
+            clerrstr(v));
+    return 1;
+  }
+  reqdLocalSize = reqd[0];
   return 0;
 }
 
@@ -4,11 +4,14 @@
 
 namespace gitmine {
 
+// getCacheDir returns $XDG_CACHE_HOME/git-mine (or ~/.cache/git-mine),
+// creating it if needed. It returns "" if there is no cache directory.
+std::string getCacheDir();
 
 class OpenCLprog {
 public:
   OpenCLprog(const char* code, OpenCLdev& dev)
-      : code(code), dev(dev), prog(NULL), kern(NULL) {}
+      : code(code), dev(dev), reqdLocalSize(0), prog(NULL), kern(NULL) {}
   virtual ~OpenCLprog() {
     if (kern) {
       clReleaseKernel(kern);
@@ -20,11 +23,17 @@ public:
     }
   }
 
+  // open builds code, or loads a binary cached by an earlier open() of the
+  // same code and buildargs on the same device and driver.
   int open(const char* mainFuncName, std::string buildargs = "");
 
   const char* const code;
   OpenCLdev& dev;
   std::string funcName;
+  std::string variant;  // Names the build options, if there is a choice.
+  // reqdLocalSize is the work-group size the kernel was compiled for with
+  // reqd_work_group_size, or 0 if any size works.
+  size_t reqdLocalSize;
 
   char* getBuildLog() {
     return reinterpret_cast<char*>(getProgramBuildInfo(CL_PROGRAM_BUILD_LOG));
@@ -49,6 +58,8 @@ public:
   cl_kernel getKern() const { return kern; }
   int copyFrom(OpenCLprog& other, const char* mainFuncName) {
     prog = other.prog;
+    variant = other.variant;
+    reqdLocalSize = other.reqdLocalSize;
     cl_int v;
     kern = clCreateKernel(prog, mainFuncName, &v);
     if (v != CL_SUCCESS) {
@@ -60,6 +71,8 @@ public:
 
 private:
   void* getProgramBuildInfo(cl_program_build_info field);
+  int loadBinary(const std::string& path, const std::string& buildargs);
+  int saveBinary(const std::string& path);
 
   cl_program prog;
   cl_kernel kern;
@@ -69,7 +82,16 @@ class OpenCLevent {
 public:
   OpenCLevent() : handle(NULL) {}
   virtual ~OpenCLevent() {
-    clReleaseEvent(handle);
+    reset();
+  }
+
+  // reset releases the event so handle can be passed to another Enqueue...
+  // function.
+  void reset() {
+    if (handle) {
+      clReleaseEvent(handle);
+      handle = NULL;
+    }
   }
 
   void waitForSignal() {
@@ -194,12 +216,15 @@ public:
     return 0;
   }
 
-  // readBufferNonBlock does a non-blocking read
+  // readBufferNonBlock does a non-blocking read that starts after waitList.
   template<typename T>
-  int readBufferNonBlock(cl_mem hnd, std::vector<T>& dst, cl_event& complete) {
+  int readBufferNonBlock(cl_mem hnd, std::vector<T>& dst, cl_event& complete,
+                         const std::vector<cl_event>& waitList
+                             = std::vector<cl_event>()) {
     cl_int v = clEnqueueReadBuffer(handle, hnd, CL_FALSE /*blocking*/,
         0 /*offset*/, sizeof(dst[0]) * dst.size(),
-        reinterpret_cast<void*>(dst.data()), 0, NULL, &complete);
+        reinterpret_cast<void*>(dst.data()), waitList.size(),
+        waitList.empty() ? NULL : waitList.data(), &complete);
     if (v != CL_SUCCESS) {
       fprintf(stderr, "%s failed: %d %s\n", "clEnqueueReadBuffer", v,
               clerrstr(v));
@@ -208,6 +233,78 @@ public:
     return 0;
   }
 
+  // writeBytes does a non-blocking write of size bytes from src that starts
+  // after waitList.
+  int writeBytes(cl_mem hnd, const void* src, size_t size,
+                 const std::vector<cl_event>& waitList =
+                     std::vector<cl_event>()) {
+    cl_int v = clEnqueueWriteBuffer(handle, hnd, CL_FALSE /*blocking*/,
+        0 /*offset*/, size, src, waitList.size(),
+        waitList.empty() ? NULL : waitList.data(), NULL);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clEnqueueWriteBuffer", v,
+              clerrstr(v));
+      return 1;
+    }
+    return 0;
+  }
+
+  // readBytes does a non-blocking read of size bytes into dst that starts
+  // after waitList.
+  int readBytes(cl_mem hnd, void* dst, size_t size, cl_event& complete,
+                const std::vector<cl_event>& waitList) {
+    cl_int v = clEnqueueReadBuffer(handle, hnd, CL_FALSE /*blocking*/,
+        0 /*offset*/, size, dst, waitList.size(),
+        waitList.empty() ? NULL : waitList.data(), &complete);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clEnqueueReadBuffer", v,
+              clerrstr(v));
+      return 1;
+    }
+    return 0;
+  }
+
+  // map maps size bytes of hnd into host memory at ptr. If complete is not
+  // NULL, the map does not block: ptr is only usable once complete fires.
+  int map(cl_mem hnd, cl_map_flags flags, size_t size, void*& ptr,
+          cl_event* complete = NULL,
+          const std::vector<cl_event>& waitList = std::vector<cl_event>()) {
+    cl_int v;
+    ptr = clEnqueueMapBuffer(handle, hnd, complete ? CL_FALSE : CL_TRUE,
+        flags, 0 /*offset*/, size, waitList.size(),
+        waitList.empty() ? NULL : waitList.data(), complete, &v);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clEnqueueMapBuffer", v,
+              clerrstr(v));
+      return 1;
+    }
+    return 0;
+  }
+
+  // unmap gives a buffer mapped at ptr back to the device.
+  int unmap(cl_mem hnd, void* ptr) {
+    cl_int v = clEnqueueUnmapMemObject(handle, hnd, ptr, 0, NULL, NULL);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clEnqueueUnmapMemObject", v,
+              clerrstr(v));
+      return 1;
+    }
+    return 0;
+  }
+
+  // marker outputs an event that is signalled when everything enqueued so far
+  // is done.
+  int marker(OpenCLevent& complete) {
+    complete.reset();
+    cl_int v = clEnqueueMarkerWithWaitList(handle, 0, NULL, &complete.handle);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clEnqueueMarkerWithWaitList", v,
+              clerrstr(v));
+      return 1;
+    }
+    return 0;
+  }
+
   OpenCLdev& dev;
 
   int NDRangeKernel(OpenCLprog& prog, cl_uint work_dim,
@@ -237,6 +334,7 @@ public:
                     OpenCLevent& completeEvent,
                     const std::vector<cl_event>& waitList
                         = std::vector<cl_event>()) {
+    completeEvent.reset();
     return NDRangeKernel(prog, work_dim, global_work_offset, global_work_size,
                          local_work_size, &completeEvent.handle, waitList);
   }
@@ -250,6 +348,16 @@ public:
     return 0;
   }
 
+  // flush submits everything enqueued so far without waiting for it.
+  int flush() {
+    cl_int v = clFlush(handle);
+    if (v != CL_SUCCESS) {
+      fprintf(stderr, "%s failed: %d %s\n", "clFlush", v, clerrstr(v));
+      return 1;
+    }
+    return 0;
+  }
+
 private:
   cl_command_queue handle;
 };
@@ -309,8 +417,11 @@ public:
   }
 
   template<typename T>
-  int copyTo(OpenCLqueue& q, std::vector<T>& out, OpenCLevent& completeEvent) {
-    return q.readBufferNonBlock(getHandle(), out, completeEvent.handle);
+  int copyTo(OpenCLqueue& q, std::vector<T>& out, OpenCLevent& completeEvent,
+             const std::vector<cl_event>& waitList = std::vector<cl_event>()) {
+    completeEvent.reset();
+    return q.readBufferNonBlock(getHandle(), out, completeEvent.handle,
+                                waitList);
   }
 
   cl_mem getHandle() const { return handle; }
@@ -324,4 +435,128 @@ inline int OpenCLprog::setArg(cl_uint argIndex, const OpenCLmem& mem) {
   return setArg(argIndex, mem.getHandle());
 }
 
+// HostMode is how the host's copy of an OpenCLhostmem reaches the device.
+enum HostMode {
+  HOST_COPY,  // Pageable memory: the driver stages every transfer.
+  HOST_PINNED,  // Copies to and from a pinned (mapped) staging buffer.
+  HOST_MAPPED,  // The buffer itself is mapped: no copy with unified memory.
+};
+
+// OpenCLhostmem is a buffer of Ts on the device plus the host's copy of it.
+// The host may use data() after hostWrite() or after toHost() completes,
+// until the next toDevice().
+template<typename T>
+class OpenCLhostmem {
+public:
+  OpenCLhostmem(OpenCLdev& dev)
+      : mem(dev), staging(dev), mode(HOST_COPY), access(0), ptr(NULL), n(0)
+      , mapped(false) {}
+
+  OpenCLmem mem;
+
+  // create allocates count Ts with flags. access is CL_MAP_WRITE if the
+  // host writes the buffer, CL_MAP_READ if it reads it back, or both.
+  int create(OpenCLqueue& q, cl_mem_flags flags, size_t count,
+             cl_map_flags access, HostMode mode) {
+    this->mode = mode;
+    this->access = access;
+    n = count;
+    void* p = NULL;
+    switch (mode) {
+      case HOST_COPY:
+        copy.resize(n);
+        ptr = copy.data();
+        return mem.create(flags, bytes());
+      case HOST_PINNED:
+        if (mem.create(flags, bytes()) ||
+            staging.create(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                           bytes()) ||
+            q.map(staging.getHandle(), CL_MAP_READ | CL_MAP_WRITE, bytes(),
+                  p)) {
+          return 1;
+        }
+        // staging stays mapped: the kernel never uses it.
+        ptr = reinterpret_cast<T*>(p);
+        return 0;
+      case HOST_MAPPED:
+        return mem.create(flags | CL_MEM_ALLOC_HOST_PTR, bytes()) ||
+               hostWrite(q);
+    }
+    return 1;
+  }
+
+  T* data() { return ptr; }
+  T& at(size_t i) { return ptr[i]; }
+  size_t size() const { return n; }
+
+  // hostWrite makes data() writable. In HOST_MAPPED mode it blocks to map
+  // the buffer, so the kernel that last used it must be done.
+  int hostWrite(OpenCLqueue& q) {
+    if (mode != HOST_MAPPED || mapped) {
+      return 0;
+    }
+    void* p;
+    cl_map_flags f = access;
+    if (f == CL_MAP_WRITE) {
+      f = CL_MAP_WRITE_INVALIDATE_REGION;
+    }
+    if (q.map(mem.getHandle(), f, bytes(), p)) {
+      return 1;
+    }
+    ptr = reinterpret_cast<T*>(p);
+    mapped = true;
+    return 0;
+  }
+
+  // toDevice enqueues on q whatever makes the host's writes visible to the
+  // device: a copy, or an unmap.
+  int toDevice(OpenCLqueue& q) {
+    if (mode == HOST_MAPPED) {
+      if (!mapped) {
+        return 0;
+      }
+      mapped = false;
+      return q.unmap(mem.getHandle(), ptr);
+    }
+    if (access & CL_MAP_WRITE) {
+      return q.writeBytes(mem.getHandle(), ptr, bytes());
+    }
+    return 0;
+  }
+
+  // toHost enqueues on q, after waitList, a copy (or a map) of the buffer
+  // to data(). complete is signalled when data() is ready.
+  int toHost(OpenCLqueue& q, OpenCLevent& complete,
+             const std::vector<cl_event>& waitList) {
+    complete.reset();
+    if (mode != HOST_MAPPED) {
+      return q.readBytes(mem.getHandle(), ptr, bytes(), complete.handle,
+                         waitList);
+    }
+    if (mapped) {
+      fprintf(stderr, "validation: OpenCLhostmem::toHost while mapped\n");
+      return 1;
+    }
+    void* p;
+    if (q.map(mem.getHandle(), access, bytes(), p, &complete.handle,
+              waitList)) {
+      return 1;
+    }
+    ptr = reinterpret_cast<T*>(p);
+    mapped = true;
+    return 0;
+  }
+
+private:
+  size_t bytes() const { return sizeof(T) * n; }
+
+  OpenCLmem staging;  // HOST_PINNED only.
+  std::vector<T> copy;  // HOST_COPY only.
+  HostMode mode;
+  cl_map_flags access;
+  T* ptr;
+  size_t n;
+  bool mapped;  // HOST_MAPPED: the host owns the buffer.
+};
+
 }  // namespace git-mine
@@ -8,14 +8,34 @@
 #include "ocl-sha1.h"
 #include "ocl-device.h"
 #include "ocl-program.h"
+#include "ocl-trace.h"
+#include "ocl-tune.h"
 #include "hashapi.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <math.h>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
 
 namespace gitmine {
 
 typedef std::chrono::steady_clock Clock;
 
-#define MIN_MATCH_LEN (5)
+// DIGIT_WORDS is how many 32-bit words of each timestamp a worker owns.
+#define DIGIT_WORDS ((size_t)4)
+// MATCH_RING is how many matches one batch can return.
+#define MATCH_RING ((size_t)64)
+// UNIT_HASHES is about how many hashes one work unit has in UNITS mode.
+#define UNIT_HASHES ((long long)256)
+// UNITS_BATCH_MULT is how much more work a UNITS mode batch gets.
+#define UNITS_BATCH_MULT (8)
+// PIPELINE_DEPTH is how many batches findOnGPU keeps in flight.
+#define PIPELINE_DEPTH ((size_t)3)
 
 static const uint32_t sha1_IV[] = {
   0x67452301,
@@ -46,185 +66,379 @@ struct B2SHAconst {
     }
     for (size_t i = 0; i < B2H_DIGEST_LEN; i++) {
       b2iv[i] = blake2b_IV[i];
+      b2mid[i] = 0;
     }
-    for (size_t i = 0; i < 4; i++) {
-      lastfullpadding[i] = 0;
-    }
-    for (size_t i = 0; i < 4; i++) {
-      lastfulllen[i] = 0;
-    }
-    for (size_t i = 0; i < 4; i++) {
-      zeropaddingandlen[i] = 0;
-    }
+    len = 0;
+    bytesRemaining = 0;
+    buffers = 0;
+    b2Remaining = 0;
+    atimeWord = 0;
+    ctimeWord = 0;
+    minMatchLen = MIN_MATCH_LEN;
+    startAtime = 0;
+    startCtime = 0;
+    hashes = 0;
+    ctimeCount = 0;
+    shares = 0;
+    mode = 0;
+    counterPos = 0;
+    ctimePos = 0;
+    pad = 0;
   }
 
   uint64_t b2iv[B2H_DIGEST_LEN];
-  uint32_t lastfullpadding[4];
-  uint32_t lastfulllen[4];
-  uint32_t zeropaddingandlen[4];
+  uint64_t b2mid[B2H_DIGEST_LEN];  // BLAKE2b state after the prefix.
   uint32_t shaiv[SHA_DIGEST_LEN];
 
   uint32_t len;  // The overall length of the message to digest.
   uint32_t bytesRemaining;  // Bytes to be digested on the GPU.
   uint32_t buffers;  // Buffers to be digested.
+  uint32_t b2Remaining;  // Bytes to be digested by BLAKE2b on the GPU.
+  uint32_t atimeWord;  // First word of the author time digits.
+  uint32_t ctimeWord;  // First word of the committer time digits.
+  uint32_t minMatchLen;  // Only matches longer than this are recorded.
+
+  // The batch: each worker derives its own share from these, the same way
+  // PrepWorkAllocator does on the CPU.
+  uint64_t startAtime;
+  uint64_t startCtime;
+  uint64_t hashes;  // Pairs in the whole batch.
+  uint32_t ctimeCount;
+  uint32_t shares;  // The batch is split into this many equal spans.
+  uint32_t mode;  // PrepWorkAllocator::WorkModes.
+  uint32_t counterPos;  // The last digit of author_time.
+  uint32_t ctimePos;  // The last digit of committer_time.
+  uint32_t pad;
+};
+
+// KernelShape holds the offsets in a commit that depend on its layout, but
+// not on its times. getKernelDefines() passes them to the kernel build.
+struct KernelShape {
+  size_t len;  // Length of the header plus the raw commit.
+  size_t counterPos;  // The last digit of author_time.
+  size_t ctimePos;  // The last digit of committer_time.
+  size_t atimeWord;  // First word of the author time digits.
+  size_t ctimeWord;  // First word of the committer time digits.
+  size_t shaSkip;  // Prefix bytes covered by the SHA-1 midstate.
+  size_t b2Skip;  // Prefix bytes covered by the BLAKE2b midstate.
+
+  int set(const CommitMessage& c) {
+    len = c.header.size() + c.toRawString().size();
+    counterPos = c.header.size() + c.parent.size() + c.author.size() +
+                 c.author_time.size() - 1;
+    ctimePos = counterPos + c.author_tz.size() + c.committer.size() +
+               c.committer_time.size();
+    size_t atimeFirst = counterPos + 1 - c.author_time.size();
+    atimeWord = atimeFirst / sizeof(uint32_t);
+    ctimeWord = (ctimePos + 1 - c.committer_time.size()) / sizeof(uint32_t);
+    if (counterPos / sizeof(uint32_t) >= atimeWord + DIGIT_WORDS ||
+        ctimePos / sizeof(uint32_t) >= ctimeWord + DIGIT_WORDS) {
+      fprintf(stderr, "KernelShape: timestamps longer than %zu bytes\n",
+              DIGIT_WORDS*sizeof(uint32_t) - sizeof(uint32_t) + 1);
+      return 1;
+    }
+    shaSkip = atimeFirst & ~(size_t)(SHA_CBLOCK - 1);
+    b2Skip = atimeFirst & ~(size_t)(BLAKE2B_BLOCKBYTES - 1);
+    return 0;
+  }
 };
 
+// NO_SHARE in B2SHAstate::share means the worker did not stop early.
+#define NO_SHARE (0xffffffffu)
+
+// B2SHAstate is what each worker leaves behind: the SHA-1 of the last
+// message it hashed, which only testGPUsha1 reads. If the batch was
+// cancelled, share and left say what the worker did not finish.
 struct B2SHAstate {
-  B2SHAstate() {
+  B2SHAstate() : share(NO_SHARE), left(0) {
     for (size_t i = 0; i < SHA_DIGEST_LEN; i++) {
       hash[i] = 0;
     }
-    counterPos = 0;
-    counts = 1;
-    matchCount = 0;
-    matchLen = MIN_MATCH_LEN;
-    ctimePos = 0;
-    ctimeCount = 1;
   }
 
   uint32_t hash[SHA_DIGEST_LEN];
+  uint32_t share;
+  uint64_t left;  // The last left pairs of share were not hashed.
+};
 
-  uint32_t counterPos;
-  uint64_t counts;
-  uint64_t matchCount;
-  uint32_t matchLen;
-  uint32_t matchCtimeCount;
-  uint32_t ctimePos;
-  uint32_t ctimeCount;
+// B2SHAmatch is one hit found by the kernel. count is the value of the
+// share's loop counter (how many hashes were left) at the hit.
+struct B2SHAmatch {
+  uint32_t worker;
+  uint32_t len;
+  uint64_t count;
 };
 
+// PrepWorkAllocator divides up the search. A batch is every (atime, ctime)
+// pair with ctime in [global_start_ctime, global_start_ctime + ctimeCount)
+// and global_start_atime <= atime <= ctime, so the batches tile the triangle
+// atime <= ctime exactly.
+//
+// The pairs of a batch are numbered in order: all the atimes of its first
+// ctime, then all the atimes of the next ctime, which has one more, and so
+// on. The batch is split into shares of consecutive pair numbers whose sizes
+// differ by at most 1, so every worker (or unit) does the same work.
 struct PrepWorkAllocator {
   PrepWorkAllocator(cl_uint maxCU, long long start_atime,
                     long long start_ctime)
-      : mode(UNDEFINED), fNumWorkers(0), ctimeCount(1), maxCU(maxCU)
-      , global_start_atime(start_atime), global_start_ctime(start_ctime) {}
+      : mode(UNDEFINED), unitQueue(false), shares(0), ctimeCount(1)
+      , maxCU(maxCU), batchScale(32), global_start_atime(start_atime)
+      , global_start_ctime(start_ctime) {}
 
   void copyCountersFrom(PrepWorkAllocator& other) {
     global_start_atime = other.global_start_atime;
     global_start_ctime = other.global_start_ctime;
+    // markAllCtimeDone() must skip the ctimes other did, not this one's.
+    ctimeCount = other.ctimeCount;
+    lease = other.lease;
+  }
+
+  // setLease restricts the work to lease, starting at its first ctime.
+  void setLease(const CtimeLease& l) {
+    lease = l;
+    global_start_atime = lease.atime_first;
+    global_start_ctime = lease.ctime_first;
+  }
+
+  // needLease returns true if every ctime in lease has been handed out.
+  bool needLease() const {
+    return lease.id && global_start_ctime >= lease.ctime_end;
+  }
+
+  // batchDoneWithLease returns true if this batch ends at the lease's end.
+  bool batchDoneWithLease() const {
+    return lease.id && global_start_ctime + ctimeCount >= lease.ctime_end;
   }
 
   void markAllCtimeDone() {
     global_start_ctime += ctimeCount;
   }
 
-  // Use an idealized GPU where 1 worker can do 1024 iterations in 0.2 sec.
-  // (That's a really slow GPU. The load will be tuned from there.)
+  // Use an idealized GPU where 1 worker can do maxCU*batchScale hashes in
+  // 0.2 sec. (That's a really slow GPU. The load will be tuned from there.)
   //
-  // This function counteracts buildGPUbuf() by estimating how long the kernel
-  // will run and only giving it about 0.2 sec of work. If n is bigger the
-  // amount of work per worker can be bigger while still fitting in 0.2 sec
+  // setNumWorkers picks ctimeCount so the batch has about that much work for
+  // each of n workers.
   int setNumWorkers(size_t n) {
-    fNumWorkers = n;
-    atime_work = global_start_ctime - global_start_atime;
-    if (atime_work < 0) {
-      fprintf(stderr, "setNumWorkers: atime_work=%lld BUG, ctime < atime\n",
-              atime_work);
-      atime_work = 0;
+    if (global_start_ctime < global_start_atime) {
+      fprintf(stderr, "setNumWorkers: ctime %lld < atime %lld BUG\n",
+              global_start_ctime, global_start_atime);
       return 1;
     }
-
-    float eachWork = 0.0f;
-    if (atime_work) {
-      mode = C_LOCKSTEP;
-      eachWork = float(n * maxCU) * 32.0f / atime_work;
-      ctimeCount = (eachWork < 1.0f) ? 1 : (unsigned)eachWork;
-    } else {
-      mode = A_LOCKSTEP;
-      atime_work = 1;
-      fprintf(stderr, "engage A_LOCKSTEP\n");
-      // Take a large number of ctime to work on.
-      ctimeCount = 1024;
+    // Units balance themselves, so a UNITS batch has no slow tail and can be
+    // longer: that means fewer kernel launches.
+    long long want = (long long)n * maxCU * batchScale *
+                     (unitQueue ? UNITS_BATCH_MULT : 1);
+    long long maxCount = UINT32_MAX;
+    if (lease.id) {
+      maxCount = lease.ctime_end - global_start_ctime;
     }
-    return 0;
+    // The kernel only rewrites the template's digits, so the batch ends
+    // before ctime gains a digit. No atime is later than its ctime.
+    long long digitCount = digitLimit(global_start_ctime) - global_start_ctime;
+    if (digitCount < maxCount) {
+      maxCount = digitCount;
+    }
+    // Find the most ctimes that fit in want, but at least 1.
+    long long lo = 1, hi = (want < maxCount) ? want : maxCount;
+    if (hi < lo) {
+      hi = lo;
+    }
+    while (lo < hi) {
+      long long mid = lo + (hi - lo + 1)/2;
+      if (rowsHashes(mid) <= want) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    return setBatch(lo, n);
   }
 
-  // getAFirst returns the first atime that should be processed by worker_i.
-  long long getAFirst(size_t worker_i) const {
-    switch (mode) {
-      case C_LOCKSTEP:
-        return global_start_atime + (long long)(
-              (float(worker_i) * atime_work) / fNumWorkers);
-      case A_LOCKSTEP:
-        return global_start_atime;
-      default:
-        fprintf(stderr, "getAFirst(%zu): mode UNDEFINED\n", worker_i);
-        exit(1);
+  // setBatch makes the batch count ctimes long, split up for n workers.
+  int setBatch(long long count, size_t n) {
+    if (count < 1 || count > (long long)UINT32_MAX) {
+      fprintf(stderr, "setBatch: %lld ctimes BUG\n", count);
+      return 1;
+    }
+    ctimeCount = count;
+    hashes = rowsHashes(ctimeCount);
+
+    mode = SPANS;
+    shares = n;
+    if (unitQueue) {
+      mode = UNITS;
+      shares = (hashes + UNIT_HASHES - 1) / UNIT_HASHES;
+    }
+    if (shares > (long long)UINT32_MAX) {
+      fprintf(stderr, "setNumWorkers: %lld shares BUG\n", shares);
+      return 1;
     }
     return 0;
   }
 
-  // getAEnd returns the atime after the last atime that should be processed.
-  long long getAEnd(size_t worker_i) const {
-    switch (mode) {
-      case C_LOCKSTEP:
-        return global_start_atime + (long long)(
-              float(worker_i + 1) * atime_work / fNumWorkers);
-      case A_LOCKSTEP:
-      {
-        // atime_work will be the minimum work allowed.
-        // Workers with a higher getCFirst() will have more atime work too.
-        // FIXME: Some kernels will run longer than others.
-        long long aend = global_start_atime + atime_work - 1;
-        long long cend = getCFirst(worker_i);
-        if (cend > aend) {
-          aend = cend;
-        }
-        return aend + 1;
-      }
-      default:
-        fprintf(stderr, "getAEnd(%zu): mode UNDEFINED\n", worker_i);
-        exit(1);
+  // digitLimit returns the first time after t that has more digits.
+  static long long digitLimit(long long t) {
+    long long limit = 10;
+    while (limit <= t) {
+      limit *= 10;
     }
-    return 0;
+    return limit;
   }
 
-  // getCFirst returns the first ctime that should be processed by worker_i.
-  long long getCFirst(size_t worker_i) const {
-    switch (mode) {
-      case C_LOCKSTEP:
-        return global_start_ctime;
-      case A_LOCKSTEP:
-        return global_start_ctime + (long long)(
-            float(worker_i) * ctimeCount / fNumWorkers);
-      default:
-        fprintf(stderr, "getCFirst(%zu): mode UNDEFINED\n", worker_i);
-        exit(1);
+  // rowsHashes returns how many pairs the batch's first k ctimes have.
+  long long rowsHashes(long long k) const {
+    return k*(global_start_ctime - global_start_atime + 1) + k*(k - 1)/2;
+  }
+
+  // The share functions use integer math so that sha1.cl, which derives the
+  // same values for each share, agrees with them exactly.
+
+  // shareFirst returns the number of share_i's first pair.
+  long long shareFirst(size_t share_i) const {
+    if (mode == UNDEFINED) {
+      fprintf(stderr, "shareFirst(%zu): mode UNDEFINED\n", share_i);
+      exit(1);
     }
-    return 0;
+    return (long long)share_i * hashes / shares;
+  }
+
+  // shareEnd returns the number of the pair after share_i's last pair.
+  long long shareEnd(size_t share_i) const {
+    return shareFirst(share_i + 1);
   }
 
-  long long getCEnd(size_t worker_i) const {
-    switch (mode) {
-      case C_LOCKSTEP:
-        return global_start_ctime + ctimeCount;
-      case A_LOCKSTEP:
-        return global_start_ctime + (long long)(
-            float(worker_i + 1) * ctimeCount / fNumWorkers);
-      default:
-        fprintf(stderr, "getCEnd(%zu): mode UNDEFINED\n", worker_i);
-        exit(1);
+  // getPair returns the times of the batch's pair number i.
+  void getPair(long long i, long long& atime, long long& ctime) const {
+    // Find the ctime (row) by bisection, as sha1.cl does.
+    long long lo = 0, hi = ctimeCount - 1;
+    while (lo < hi) {
+      long long mid = lo + (hi - lo + 1)/2;
+      if (rowsHashes(mid) <= i) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
     }
-    return 0;
+    ctime = global_start_ctime + lo;
+    atime = global_start_atime + i - rowsHashes(lo);
   }
 
   long long workCount() const {
-    return (global_start_ctime - global_start_atime) * ctimeCount;
+    return hashes;
   }
 
+  // sha1.cl has the same values as WORK_SPANS, etc.
   enum WorkModes {
-    UNDEFINED,
-    C_LOCKSTEP,
-    A_LOCKSTEP,
+    UNDEFINED = 0,
+    SPANS = 1,  // Each worker does one share.
+    UNITS = 2,  // Persistent workers claim shares (units) from a queue.
   };
 
   WorkModes mode;
-  float fNumWorkers;
+  bool unitQueue;  // Use UNITS mode.
+  long long shares;
   unsigned ctimeCount;
+  long long hashes;  // Pairs in the batch.
   cl_uint maxCU;
-  long long atime_work;
+  unsigned batchScale;  // Scales the work per worker. See TuneConfig.
   long long global_start_atime;
   long long global_start_ctime;
+  CtimeLease lease;  // lease.id is 0 if there is no lease.
+};
+
+// testWorkAllocator checks that PrepWorkAllocator's shares of a few batches
+// cover every pair exactly once, and that their sizes differ by at most 1.
+static int testWorkAllocator() {
+  const long long gaps[] = { 0, 1, 5, 300 };
+  const size_t workers[] = { 1, 3, 64 };
+  for (long long gap : gaps) {
+    for (size_t n : workers) {
+      for (int units = 0; units < 2; units++) {
+        PrepWorkAllocator govt(1, 1000, 1000 + gap);
+        govt.batchScale = 40;
+        govt.unitQueue = units;
+        if (govt.setNumWorkers(n)) {
+          return 1;
+        }
+        // Run two batches, to check that they tile too.
+        std::vector<int> seen;
+        long long cEnd = govt.global_start_ctime;
+        for (int b = 0; b < 2; b++) {
+          if (b) {
+            govt.markAllCtimeDone();
+            if (govt.setNumWorkers(n)) {
+              return 1;
+            }
+          }
+          cEnd = govt.global_start_ctime + govt.ctimeCount;
+          seen.resize((cEnd - 1000)*(cEnd - 1000 + 1)/2 + (cEnd - 1000));
+          long long minSize = govt.hashes, maxSize = 0;
+          for (long long w = 0; w < govt.shares; w++) {
+            long long size = govt.shareEnd(w) - govt.shareFirst(w);
+            minSize = std::min(minSize, size);
+            maxSize = std::max(maxSize, size);
+            for (long long i = govt.shareFirst(w); i < govt.shareEnd(w); i++) {
+              long long a, c;
+              govt.getPair(i, a, c);
+              if (a < govt.global_start_atime || a > c ||
+                  c < govt.global_start_ctime || c >= cEnd) {
+                fprintf(stderr, "testWorkAllocator: pair %lld is (%lld, "
+                        "%lld), outside the batch\n", i, a, c);
+                return 1;
+              }
+              // Pairs up to ctime c are numbered as a triangle.
+              seen.at((c - 1000)*(c - 1000 + 1)/2 + (a - 1000))++;
+            }
+          }
+          if (maxSize - minSize > 1) {
+            fprintf(stderr, "testWorkAllocator: shares of %lld to %lld "
+                    "hashes\n", minSize, maxSize);
+            return 1;
+          }
+        }
+        // Every pair from the first batch's ctime on is seen once.
+        for (long long c = 1000 + gap; c < cEnd; c++) {
+          for (long long a = 1000; a <= c; a++) {
+            int count = seen.at((c - 1000)*(c - 1000 + 1)/2 + (a - 1000));
+            if (count != 1) {
+              fprintf(stderr, "testWorkAllocator: (%lld, %lld) seen %d "
+                      "times, gap=%lld n=%zu units=%d\n", a, c, count, gap,
+                      n, units);
+              return 1;
+            }
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// PipeQueues holds one queue for uploads, one for the kernel and one for
+// reading back results. Events order the work of a batch across them, so
+// one batch can upload while another runs, without a clFinish.
+struct PipeQueues {
+  PipeQueues(OpenCLdev& dev) : up(dev), run(dev), down(dev), stop(dev) {}
+
+  int open() {
+    if (up.open() || run.open() || down.open() || stop.open()) {
+      fprintf(stderr, "PipeQueues: open failed\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  int finish() {
+    return up.finish() || run.finish() || down.finish() || stop.finish();
+  }
+
+  OpenCLqueue up;
+  OpenCLqueue run;
+  OpenCLqueue down;
+  // stop only has the writes from CPUprep::cancel(), so nothing queued
+  // behind a kernel can hold them up.
+  OpenCLqueue stop;
 };
 
 // CPUprep prepares the work for sha1.cl, and holds its output.
@@ -232,47 +446,85 @@ struct PrepWorkAllocator {
 // to write.
 //
 // The most important part here is that the code iterates the atime and ctime.
-// The atime must be <= ctime, so work is divided up to compute all possible
-// atimes without changing ctime, then increment ctime.
-//
-// There are tricky cases for computing the last few atimes up to the ctime,
-// ctime itself changing each time, so that part may not be as efficient.
-//
-// If there are more workers than atimes, give each worker a single atime and
-// divide up a large chunk of ctimes. This produces lots more atimes by running
-// up the ctime.
+// The atime must be <= ctime, so each batch takes a run of ctimes with all
+// of their atimes. See PrepWorkAllocator for how a batch is split up.
 struct CPUprep {
-  CPUprep(OpenCLdev& dev, OpenCLprog& prog, OpenCLqueue& q,
+  CPUprep(OpenCLdev& dev, OpenCLprog& prog, PipeQueues& qs,
           const CommitMessage& commit, long long start_atime,
           long long start_ctime)
-      : dev(dev), prog(prog), q(q), commit(commit), gpufixed(dev)
-      , gpustate(dev), gpubuf(dev), fixed(1), testOnly(0), wantValidTime(1)
+      : dev(dev), prog(prog), qs(qs), commit(commit), gpufixed(dev)
+      , gpustate(dev), gpubuf(dev), gpumatchCount(dev), gpumatches(dev)
+      , gpunextUnit(dev), gpucancel(dev)
+      , hostMode(dev.info.hostUnified ? HOST_MAPPED : HOST_PINNED)
+      , numWorkers(0), testOnly(0), wantValidTime(1), inFlight(false)
+      , cancelled(false), undone(0), trace(NULL)
+      , minMatchLen(MIN_MATCH_LEN)
       , prev_work_done(0), total_work_done(0), timesValid(false)
       , govt(dev.info.maxCU, start_atime, start_ctime) {}
 
   OpenCLdev& dev;
   OpenCLprog& prog;
-  OpenCLqueue& q;
+  PipeQueues& qs;
   const CommitMessage& commit;
 
-  OpenCLmem gpufixed;
+  // The buffers the host writes or reads each batch have a host copy in
+  // pinned memory, or are mapped if the device shares the host's memory.
+  OpenCLhostmem<B2SHAconst> gpufixed;
   OpenCLmem gpustate;
-  OpenCLmem gpubuf;
-  OpenCLevent completeEvent;
-  std::vector<B2SHAstate> state;
-  std::vector<B2SHAstate> result;
-  std::vector<B2SHAconst> fixed;
-  std::vector<B2SHAbuffer> cpubuf;
+  OpenCLhostmem<B2SHAbuffer> gpubuf;
+  OpenCLhostmem<uint32_t> gpumatchCount;
+  OpenCLhostmem<B2SHAmatch> gpumatches;
+  OpenCLhostmem<uint32_t> gpunextUnit;  // The next unit, in UNITS mode.
+  // gpucancel is set by cancel() to stop the kernel. It is never mapped:
+  // both writes to it are queued.
+  OpenCLmem gpucancel;
+  const HostMode hostMode;
+  OpenCLevent uploadStartEvent;  // Before the uploads, if tracing.
+  OpenCLevent uploadEvent;  // Signalled when the batch is on the GPU.
+  OpenCLevent kernelEvent;  // Signalled when the kernel is done.
+  OpenCLevent countEvent;  // Signalled when gpumatchCount is read back.
+  OpenCLevent completeEvent;  // Signalled when the results are read back.
+  size_t numWorkers;  // The global work size of the batch.
+  std::vector<B2SHAstate> result;  // Only read back by testGPUsha1.
+  std::vector<B2SHAmatch> matches;  // The matches of the last batch.
   int testOnly;
   int wantValidTime;
-
-  void writePadding(uint32_t* a, size_t len) {
-    a[(len/4) & 3] = 0x80 << (24 - (len & 3)*8);
-  }
-
-  void writeLen(uint32_t* a, size_t len) {
-    a[2] = len >> (32-3);
-    a[3] = len << 3;
+  TuneConfig tune;  // The config of the last batch built.
+  bool inFlight;  // start() was called, but not wait().
+  bool cancelled;  // cancel() was called for this batch.
+  long long undone;  // Pairs the cancelled batch did not hash.
+  TraceWriter* trace;  // If not NULL, wait() records the batch's commands.
+  Clock::time_point kernelQueued;  // Just before the kernel was enqueued.
+  uint32_t minMatchLen;  // Only matches longer than this are reported.
+
+  // writeMidstate hashes the bytes before the first digit of author_time,
+  // which are the same for every worker and every count. The kernel then
+  // resumes from the saved state and only hashes the tail.
+  void writeMidstate(B2SHAconst& f, const std::vector<char>& buf,
+                     const KernelShape& shape) {
+    size_t shaSkip = shape.shaSkip;
+    SHA_CTX sha;
+    SHA1_Init(&sha);
+    SHA1_Update(&sha, buf.data(), shaSkip);
+    f.shaiv[0] = sha.h0;
+    f.shaiv[1] = sha.h1;
+    f.shaiv[2] = sha.h2;
+    f.shaiv[3] = sha.h3;
+    f.shaiv[4] = sha.h4;
+    f.bytesRemaining = buf.size() - shaSkip;
+
+    // blake2b_update() holds back the last full block (it might be the final
+    // block), so feed it one more byte to compress all of the prefix blocks.
+    size_t b2Skip = shape.b2Skip;
+    blake2b_state b2;
+    blake2b_init(&b2, BLAKE2B_OUTBYTES);
+    if (b2Skip) {
+      blake2b_update(&b2, buf.data(), b2Skip + 1);
+    }
+    for (size_t i = 0; i < B2H_DIGEST_LEN; i++) {
+      f.b2mid[i] = b2.h[i];
+    }
+    f.b2Remaining = buf.size() - b2Skip;
   }
 
   void copyCountersFrom(CPUprep& other) {
@@ -283,23 +535,82 @@ struct CPUprep {
     govt.markAllCtimeDone();
   }
 
+  void setLease(const CtimeLease& lease) {
+    govt.setLease(lease);
+  }
+
+  bool needLease() const {
+    return govt.needLease();
+  }
+
+  bool batchDoneWithLease() const {
+    return govt.batchDoneWithLease();
+  }
+
+  const CtimeLease& getLease() const {
+    return govt.lease;
+  }
+
   // setNumWorkers sets the control parameters to assign work to each worker.
   int setNumWorkers(size_t n) {
-    state.resize(n);
+    numWorkers = n;
     return govt.setNumWorkers(n);
   }
 
-  void updateNoodleWithResultAt(size_t i, CommitMessage& noodle) {
-    noodle.set_atime(govt.getAEnd(i) - result.at(i).matchCount);
-    noodle.set_ctime(govt.getCEnd(0) - result.at(i).matchCtimeCount);
+  // setBatch sets the next batch to count ctimes for n workers, instead of
+  // sizing it from n like setNumWorkers does.
+  int setBatch(long long count, size_t n) {
+    numWorkers = n;
+    return govt.setBatch(count, n);
+  }
+
+  // setUnitQueue makes the kernel's workers persistent: they claim units
+  // of work from a queue until the batch is done.
+  void setUnitQueue(bool on) {
+    govt.unitQueue = on;
+  }
+
+  // setTune applies c to the next batch.
+  int setTune(const TuneConfig& c) {
+    tune = c;
+    govt.batchScale = c.batchScale;
+    return setNumWorkers(c.numWorkers);
+  }
+
+  void updateNoodleWithMatch(const B2SHAmatch& m, CommitMessage& noodle) {
+    long long atime, ctime;
+    govt.getPair(govt.shareEnd(m.worker) - m.count, atime, ctime);
+    noodle.set_atime(atime);
+    noodle.set_ctime(ctime);
   }
 
   long long getC() const {
-    return govt.getCFirst(0);
+    return govt.global_start_ctime;
+  }
+
+  // digitsFit returns true if the times from the next batch's start have
+  // as many digits as the commit the kernel was built for. setNumWorkers
+  // keeps each batch below the next power of ten, so only a batch that
+  // starts at one, or a commit whose atime has fewer digits than its ctime,
+  // does not fit.
+  bool digitsFit() const {
+    size_t a = std::to_string(commit.atime()).size();
+    return a == std::to_string(commit.ctime()).size() &&
+           a == std::to_string(govt.global_start_atime).size() &&
+           a == std::to_string(govt.global_start_ctime).size();
   }
 
   long long getCCount() const {
-    return govt.getCEnd(0) - govt.getCFirst(0);
+    return govt.ctimeCount;
+  }
+
+  // getPair outputs the times of pair number i of the batch.
+  void getPair(long long i, long long& atime, long long& ctime) const {
+    govt.getPair(i, atime, ctime);
+  }
+
+  long long getHashes() const {
+    return govt.hashes;
   }
 
   long long getWorkCount() const {
@@ -320,23 +631,42 @@ struct CPUprep {
                     / sizeof(B2SHAbuffer);
     std::vector<B2SHAstate> onestate;
     onestate.resize(1);
-    if (gpustate.createIO(q, onestate, maxWorkers)) {
+    if (gpustate.createIO(qs.up, onestate, maxWorkers)) {
       fprintf(stderr, "gpuState.createIO failed: maxWorkers=%zu\n", maxWorkers);
       return 1;
     }
-    std::vector<B2SHAbuffer> onebuf;
-    onebuf.resize(1);
-    if (gpubuf.createIO(q, onebuf, maxWorkers * bufsPerWorker)) {
-      fprintf(stderr, "gpubuf.createInput failed (%zu)\n",
-              maxWorkers * bufsPerWorker);
+    // All workers share one copy of the message.
+    if (gpufixed.create(qs.up, CL_MEM_READ_ONLY, 1, CL_MAP_WRITE, hostMode) ||
+        gpubuf.create(qs.up, CL_MEM_READ_ONLY, bufsPerWorker, CL_MAP_WRITE,
+                      hostMode)) {
+      fprintf(stderr, "gpubuf.create failed (%zu)\n", bufsPerWorker);
+      return 1;
+    }
+    // buildGPUbuf() zeroes gpumatchCount and gpunextUnit for each batch.
+    if (gpumatchCount.create(qs.up, CL_MEM_READ_WRITE, 1,
+                             CL_MAP_READ | CL_MAP_WRITE, hostMode) ||
+        gpumatches.create(qs.up, CL_MEM_WRITE_ONLY, MATCH_RING, CL_MAP_READ,
+                          hostMode) ||
+        gpunextUnit.create(qs.up, CL_MEM_READ_WRITE, 1, CL_MAP_WRITE,
+                           hostMode) ||
+        gpucancel.create(CL_MEM_READ_ONLY, sizeof(uint32_t))) {
+      fprintf(stderr, "gpumatches.create failed\n");
+      return 1;
+    }
+    if (prog.setArg(0, gpufixed.mem) || prog.setArg(1, gpustate) ||
+        prog.setArg(2, gpubuf.mem) || prog.setArg(3, gpumatchCount.mem) ||
+        prog.setArg(4, gpumatches.mem) || prog.setArg(5, gpunextUnit.mem) ||
+        prog.setArg(6, gpucancel)) {
+      fprintf(stderr, "prog.setArg failed\n");
       return 1;
     }
     return 0;
   }
 
   // buildGPUbuf creates gpubuf and populates it from commit.
-  // state.size() should be set to the number of kernel executions to divide
-  // the work into.
+  // numWorkers should be set to the number of kernel executions to divide
+  // the work into. The work does not depend on numWorkers: each worker
+  // derives its share and renders its own digits on the GPU.
   int buildGPUbuf() {
     saveWorkCountToPrev();
     total_work_done += govt.workCount();
@@ -349,158 +679,233 @@ struct CPUprep {
               govt.global_start_ctime, commit.ctime());
       return 1;
     }
-    if (fixed.size() != 1) {
-      fprintf(stderr, "BUG: fixed.size=%zu\n", fixed.size());
+    if (!gpubuf.mem.getHandle()) {
+      fprintf(stderr, "BUG: must call allocState() before buildGPUbuf()\n");
       return 1;
     }
-    result.resize(state.size());
-
+    // This CPUprep's last batch is done, so its buffers can be mapped.
+    if (gpufixed.hostWrite(qs.up) || gpubuf.hostWrite(qs.up) ||
+        gpumatchCount.hostWrite(qs.up) || gpunextUnit.hostWrite(qs.up)) {
+      fprintf(stderr, "buildGPUbuf: hostWrite failed\n");
+      return 1;
+    }
+    // Build the message template once. Workers differ only in their digits.
     CommitMessage noodle(commit);
-    cpubuf.clear();
-    for (size_t i = 0; i < state.size(); i++) {
-      if (0 && !gpubuf.getHandle() && (i & 8191) == 8191) {
-        fprintf(stderr, "cpu: create %6zu/%zu threads\n", i, state.size());
-      }
-      noodle.set_atime(govt.getAFirst(i));
-      noodle.set_ctime(govt.getCFirst(i));
-
-      // counterPos points to the last digit in author.
-      state.at(i).counterPos = noodle.header.size() + noodle.parent.size() +
-                              noodle.author.size() + noodle.author_time.size()
-                              - 1;
-      state.at(i).ctimePos = state.at(i).counterPos + noodle.author_tz.size() +
-                             noodle.committer.size() +
-                             noodle.committer_time.size();
-      state.at(i).counts = (uint32_t) (govt.getAEnd(i) - govt.getAFirst(i));
-      state.at(i).ctimeCount = govt.getCEnd(i) - govt.getCFirst(i);
-      if (testOnly) {
-        state.at(i).counts = 1;
-        state.at(i).ctimeCount = 1;
-      }
+    noodle.set_atime(govt.global_start_atime);
+    noodle.set_ctime(govt.global_start_ctime);
 
-      // buf contains the raw commit bytes.
-      std::vector<char> buf(noodle.header.data(),
-                            noodle.header.data() + noodle.header.size());
-      {
-        std::string s = noodle.toRawString();
-        buf.insert(buf.end(), s.c_str(), s.c_str() + s.size());
-      }
-      if (i != 0 && buf.size() != fixed.at(0).len) {
-        fprintf(stderr, "BUG: buf.size %zu, want %u\n", buf.size(),
-                fixed.at(0).len);
-        return 1;
-      }
-
-      // First copy buf into B2SHAbuffer-sized chunks on the CPU.
-      for (size_t i = 0; i < buf.size(); ) {
-        cpubuf.emplace_back();
-        size_t len = sizeof(B2SHAbuffer);
-        if (buf.size() - i < len) {
-          len = buf.size() - i;
-          memset(&cpubuf.back(), 0, sizeof(B2SHAbuffer));
-        }
-        memcpy(&cpubuf.back(), &buf.at(i), len);
-        i += len;
-      }
+    KernelShape shape;
+    if (shape.set(noodle)) {
+      return 1;
+    }
 
-      if (i == 0) {
-        // Use buf to find fixed parameters.
-        if (cpubuf.size() != (buf.size() + sizeof(B2SHAbuffer) - 1) /
-                            sizeof(B2SHAbuffer)) {
-          fprintf(stderr, "BUG: cpubuf %zu, want %zu\n", cpubuf.size(),
-                  buf.size() / sizeof(B2SHAbuffer));
-          return 1;
-        }
-        fixed.at(0).len = buf.size();
-        fixed.at(0).bytesRemaining = buf.size();
-        fixed.at(0).buffers = cpubuf.size();
-        if ((buf.size() & 63) != 0) {
-          writePadding(fixed.at(0).lastfullpadding, buf.size());
-          if ((buf.size() & 63) < 56) {
-            writeLen(fixed.at(0).lastfulllen, buf.size());
-          }
-        } else {
-          writePadding(fixed.at(0).zeropaddingandlen, buf.size());
-          writeLen(fixed.at(0).zeropaddingandlen, buf.size());
-        }
-      }
+    // buf contains the raw commit bytes.
+    std::vector<char> buf(noodle.header.data(),
+                          noodle.header.data() + noodle.header.size());
+    {
+      std::string s = noodle.toRawString();
+      buf.insert(buf.end(), s.c_str(), s.c_str() + s.size());
     }
 
-    // Now create gpubuf and copy cpubuf to it.
-    if (!gpubuf.getHandle()) {
-      fprintf(stderr, "BUG: must call allocState() before buildGPUbuf()\n");
+    // Copy buf into B2SHAbuffer-sized chunks, padded with zeroes.
+    size_t buffers = (buf.size() + sizeof(B2SHAbuffer) - 1) /
+                     sizeof(B2SHAbuffer);
+    if (buffers != gpubuf.size()) {
+      fprintf(stderr, "BUG: %zu buffers, want %zu\n", buffers, gpubuf.size());
+      return 1;
+    }
+    memset(gpubuf.data(), 0, buffers * sizeof(B2SHAbuffer));
+    memcpy(gpubuf.data(), buf.data(), buf.size());
+
+    // Use buf to find fixed parameters.
+    B2SHAconst& f = gpufixed.at(0);
+    f = B2SHAconst();
+    if (buf.size() != shape.len) {
+      fprintf(stderr, "BUG: buf.size %zu, want %zu\n", buf.size(), shape.len);
       return 1;
     }
-    // gpubuf already created.
-    if (q.writeBuffer(gpubuf.getHandle(), cpubuf)) {
-      fprintf(stderr, "writeBuffer(gpubuf) failed while resetting gpubuf\n");
+    f.len = buf.size();
+    f.buffers = buffers;
+    f.minMatchLen = minMatchLen;
+    f.atimeWord = shape.atimeWord;
+    f.ctimeWord = shape.ctimeWord;
+    writeMidstate(f, buf, shape);
+    f.counterPos = shape.counterPos;
+    f.ctimePos = shape.ctimePos;
+
+    // Describe the batch. The workers' times all have as many digits as the
+    // template's, since the kernel only rewrites the template's digits. The
+    // batch's last pair has the largest atime and ctime.
+    long long lastA, lastC;
+    govt.getPair(govt.hashes - 1, lastA, lastC);
+    if (std::to_string(lastA).size() !=
+            std::to_string(govt.global_start_atime).size() ||
+        std::to_string(lastC).size() !=
+            std::to_string(govt.global_start_ctime).size()) {
+      fprintf(stderr, "BUG: batch at ctime %lld changes the digit count\n",
+              govt.global_start_ctime);
       return 1;
     }
+    f.startAtime = govt.global_start_atime;
+    f.startCtime = govt.global_start_ctime;
+    f.hashes = govt.hashes;
+    f.ctimeCount = govt.ctimeCount;
+    f.shares = govt.shares;
+    f.mode = govt.mode;
+    if (testOnly) {
+      // Worker 0 hashes exactly one message. Any others do nothing.
+      f.mode = PrepWorkAllocator::SPANS;
+      f.hashes = 1;
+      f.ctimeCount = 1;
+      f.shares = 1;
+    }
 
-    // Copy fixed and state to GPU.
-    if (!gpustate.getHandle()) {
-      fprintf(stderr, "BUG: must call allocState() before buildGPUbuf()\n");
+    gpumatchCount.at(0) = 0;
+    gpunextUnit.at(0) = 0;
+    cancelled = false;
+    undone = 0;
+
+    // Hand the buffers to the GPU. gpumatches is only unmapped, if mapped.
+    // gpustate is only written by the kernel.
+    if (trace && qs.up.marker(uploadStartEvent)) {
+      fprintf(stderr, "marker(uploadStartEvent) failed\n");
       return 1;
     }
-    if (q.writeBuffer(gpustate.getHandle(), state)) {
-      fprintf(stderr, "writeBuffer(gpustate) failed\n");
+    static const uint32_t zero = 0;
+    if (gpufixed.toDevice(qs.up) || gpubuf.toDevice(qs.up) ||
+        gpumatchCount.toDevice(qs.up) || gpunextUnit.toDevice(qs.up) ||
+        gpumatches.toDevice(qs.up) ||
+        qs.up.writeBytes(gpucancel.getHandle(), &zero, sizeof(zero))) {
+      fprintf(stderr, "buildGPUbuf: toDevice failed\n");
       return 1;
     }
-    if (gpufixed.getHandle()) {
-      // gpufixed and gpustate already created.
-      if (q.writeBuffer(gpufixed.getHandle(), fixed)) {
-        fprintf(stderr, "writeBuffer(gpufixed) failed\n");
-        return 1;
-      }
-    } else {
-      if (gpufixed.createInput(q, fixed)) {
-        fprintf(stderr, "gpufixed.createInput failed\n");
-        return 1;
-      }
-      // Set program arguments.
-      if (prog.setArg(0, gpufixed) || prog.setArg(1, gpustate) ||
-          prog.setArg(2, gpubuf)) {
-        fprintf(stderr, "prog.setArg failed\n");
-        return 1;
-      }
+    // qs.up is in order, so this fires after all of the writes above.
+    if (qs.up.marker(uploadEvent)) {
+      fprintf(stderr, "marker(uploadEvent) failed\n");
+      return 1;
     }
     return 0;
   }
 
   int start(std::vector<size_t> global_work_size) {
     size_t* local_size = NULL;  // OpenCL can auto-tune local_size.
-    if (q.NDRangeKernel(prog, global_work_size.size(), NULL, 
-                        global_work_size.data(), local_size)) {
+    if (tune.localSize) {
+      local_size = &tune.localSize;
+    } else if (prog.reqdLocalSize) {
+      local_size = &prog.reqdLocalSize;
+    }
+    kernelQueued = Clock::now();
+    if (qs.run.NDRangeKernel(prog, global_work_size.size(), NULL,
+                             global_work_size.data(), local_size,
+                             kernelEvent, { uploadEvent.handle })) {
       fprintf(stderr, "NDRangeKernel failed\n");
       return 1;
     }
-    if (gpustate.copyTo(q, result, completeEvent)) {
-      fprintf(stderr, "gpustate.copyTo or finish failed\n");
+    // The whole ring is read back with the count, so wait() never has to go
+    // back to the GPU. qs.down is in order, so completeEvent covers both.
+    if (gpumatchCount.toHost(qs.down, countEvent, { kernelEvent.handle }) ||
+        gpumatches.toHost(qs.down, completeEvent, { kernelEvent.handle })) {
+      fprintf(stderr, "gpumatches.toHost failed\n");
       return 1;
     }
+    inFlight = true;
     return 0;
   }
 
-  int wait() {
-    completeEvent.waitForSignal();
-    if (wantValidTime) {
-      if (q.finish()) {
+  // cancel tells the kernel to stop. It polls the flag every CANCEL_POLL
+  // pairs and between units, so it stops soon if it is already running.
+  // The write goes on qs.stop, which runs alongside the kernel on qs.run.
+  // It waits for uploadEvent, so it lands after buildGPUbuf clears the flag.
+  int cancel() {
+    static const uint32_t one = 1;
+    cancelled = true;
+    if (qs.stop.writeBytes(gpucancel.getHandle(), &one, sizeof(one),
+                           { uploadEvent.handle }) ||
+        qs.stop.flush()) {
+      fprintf(stderr, "cancel: writeBytes failed\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  // findUndone reads back what the workers of a cancelled batch did not
+  // hash, and takes it out of the work count.
+  int findUndone() {
+    std::vector<B2SHAstate> states(numWorkers);
+    std::vector<uint32_t> claimed(1);
+    if (gpustate.copyTo(qs.down, states) ||
+        qs.down.readBuffer(gpunextUnit.mem.getHandle(), claimed)) {
+      fprintf(stderr, "findUndone: read failed\n");
+      return 1;
+    }
+    undone = 0;
+    for (const auto& st : states) {
+      if (st.share == NO_SHARE) {
+        continue;
+      }
+      if (st.share >= govt.shares ||
+          st.left > (uint64_t)(govt.shareEnd(st.share) -
+                               govt.shareFirst(st.share))) {
+        fprintf(stderr, "BUG: share %u left %llu\n", st.share,
+                (unsigned long long)st.left);
         return 1;
       }
-      timesValid = true;
-    } else {
-      timesValid = false;
+      undone += st.left;
+    }
+    // In UNITS mode the units no worker claimed were not started.
+    if (govt.mode == PrepWorkAllocator::UNITS &&
+        claimed.at(0) < govt.shares) {
+      undone += govt.hashes - govt.shareFirst(claimed.at(0));
     }
+    total_work_done -= undone;
     return 0;
   }
 
+  int wait() {
+    completeEvent.waitForSignal();
+    inFlight = false;
+    // The next batch clears the flag, so the write to set it must be done.
+    if (cancelled && (qs.stop.finish() || findUndone())) {
+      return 1;
+    }
+    // kernelEvent has its profiling info now, without draining the queues.
+    timesValid = wantValidTime;
+    if (trace) {
+      traceBatch();
+    }
+    size_t n = gpumatchCount.at(0);
+    if (n > MATCH_RING) {
+      fprintf(stderr, "%zu matches, only %zu kept\n", n, MATCH_RING);
+      n = MATCH_RING;
+    }
+    matches.assign(gpumatches.data(), gpumatches.data() + n);
+    return 0;
+  }
+
+  // traceBatch records the finished batch's upload, kernel and readback.
+  void traceBatch() {
+    char args[128];
+    snprintf(args, sizeof(args), "\"ct\":%lld,\"cn\":%lld,\"workers\":%zu",
+             getC(), getCCount(), numWorkers);
+    trace->sync(kernelQueued, kernelEvent);
+    if (uploadStartEvent.handle) {
+      trace->deviceSpan(TraceWriter::UPLOAD, "upload", uploadStartEvent,
+                        uploadEvent, args);
+    }
+    trace->deviceSpan(TraceWriter::KERNEL,
+                      cancelled ? "kernel (cancelled)" : "kernel",
+                      kernelEvent, kernelEvent, args);
+    trace->deviceSpan(TraceWriter::READBACK, "readback", countEvent,
+                      completeEvent, args);
+  }
+
   float submitTime() {
     cl_ulong submitT, endT;
-    if (completeEvent.getSubmitTime(submitT)) {
+    if (kernelEvent.getSubmitTime(submitT)) {
       fprintf(stderr, "submitTime: getSubmitTime failed\n");
       return 0;
     }
-    if (completeEvent.getEndTime(endT)) {
+    if (kernelEvent.getEndTime(endT)) {
       fprintf(stderr, "submitTime: getEndTime failed\n");
       return 0;
     }
@@ -509,12 +914,12 @@ struct CPUprep {
 
   float execTime() {
     cl_ulong startT, endT;
-    if (completeEvent.getStartTime(startT)) {
-      fprintf(stderr, "submitTime: getStartTime failed\n");
+    if (kernelEvent.getStartTime(startT)) {
+      fprintf(stderr, "execTime: getStartTime failed\n");
       return 0;
     }
-    if (completeEvent.getEndTime(endT)) {
-      fprintf(stderr, "submitTime: getEndTime failed\n");
+    if (kernelEvent.getEndTime(endT)) {
+      fprintf(stderr, "execTime: getEndTime failed\n");
       return 0;
     }
     return float(endT - startT) * 1e-9;
@@ -522,8 +927,10 @@ struct CPUprep {
 
   bool validTiming() const { return timesValid; }
 
+  // getWorkRate uses the kernel's own run time. With batches queued behind
+  // each other, the time since submit would include the wait for the others.
   float getWorkRate() {
-    return getWorkSincePrev() / submitTime();
+    return getWorkSincePrev() / execTime();
   }
 
  protected:
@@ -533,23 +940,37 @@ struct CPUprep {
   PrepWorkAllocator govt;
 };
 
+int getKernelDefines(const CommitMessage& commit, std::string& defines) {
+  KernelShape shape;
+  if (shape.set(commit)) {
+    return 1;
+  }
+  char buf[512];
+  snprintf(buf, sizeof(buf), "-DMSG_LEN=%zuu -DSHA_REMAINING=%zuu "
+           "-DB2_REMAINING=%zuu -DATIME_WORD=%zuu -DCTIME_WORD=%zuu "
+           "-DCOUNTER_POS=%zuu -DCTIME_POS=%zuu", shape.len,
+           shape.len - shape.shaSkip, shape.len - shape.b2Skip,
+           shape.atimeWord, shape.ctimeWord, shape.counterPos, shape.ctimePos);
+  defines = buf;
+  return 0;
+}
+
 // Test that the GPU kernel produces the same hash as the CPU.
 static int testGPUsha1(OpenCLdev& dev, OpenCLprog& prog,
                        const CommitMessage& commit) {
-  OpenCLqueue q(dev);
-  if (q.open()) {
-    fprintf(stderr, "q.open failed\n");
+  PipeQueues qs(dev);
+  if (qs.open()) {
     return 1;
   }
-  CPUprep prep(dev, prog, q, commit, commit.atime(), commit.ctime());
-  fprintf(stderr, "testGPUsha1: setNumWorkers(1)\n");
-  prep.setNumWorkers(1);
-  fprintf(stderr, "testGPUsha1: setNumWorkers(1) DONE\n");
-  if (prep.allocState(1)) {
+  CPUprep prep(dev, prog, qs, commit, commit.atime(), commit.ctime());
+  // A kernel built with reqd_work_group_size needs a whole work-group.
+  size_t n = prog.reqdLocalSize ? prog.reqdLocalSize : 1;
+  prep.setNumWorkers(n);
+  if (prep.allocState(n)) {
     return 1;
   }
-  // Defaults for state.at(0) do not need to be modified.
   prep.testOnly = 1;
+  prep.result.resize(1);
 
   Sha1Hash cpusha;
   cpusha.update(commit.header.data(), commit.header.size());
@@ -561,10 +982,14 @@ static int testGPUsha1(OpenCLdev& dev, OpenCLprog& prog,
     fprintf(stderr, "test: prep.buildGPUbuf failed\n");
     return 1;
   }
-  if (prep.start({ prep.state.size() }) || prep.wait()) {
+  if (prep.start({ prep.numWorkers }) || prep.wait()) {
     fprintf(stderr, "test: prep.start or prep.wait failed\n");
     return 1;
   }
+  if (prep.gpustate.copyTo(qs.down, prep.result)) {
+    fprintf(stderr, "test: gpustate.copyTo failed\n");
+    return 1;
+  }
   Sha1Hash shaout;
   memcpy(shaout.result, prep.result.at(0).hash, sizeof(shaout.result));
 
@@ -583,8 +1008,526 @@ static int testGPUsha1(OpenCLdev& dev, OpenCLprog& prog,
   return 0;
 }
 
+// CANCEL_TEST_SEC is how long testCancel's running batch would take if
+// cancel() did not stop it.
+#define CANCEL_TEST_SEC (10)
+
+// testCancel checks that a batch cancelled before its kernel starts hashes
+// nothing, and that all of its pairs are counted as not done. It then starts
+// a batch of about CANCEL_TEST_SEC at rate hashes per second and cancels
+// it: it must stop early, and the pairs done and not done must add up.
+static int testCancel(OpenCLdev& dev, OpenCLprog& prog,
+                      const CommitMessage& commit, float rate) {
+  PipeQueues qs(dev);
+  if (qs.open()) {
+    return 1;
+  }
+  long long gap = commit.ctime() - commit.atime();
+  long long want = (long long)(rate * CANCEL_TEST_SEC);
+  long long count = 1;
+  while (count*(gap + 1) + count*(count - 1)/2 < want) {
+    count *= 2;
+  }
+  for (int units = 0; units < 2; units++) {
+    CPUprep prep(dev, prog, qs, commit, commit.atime(), commit.ctime());
+    size_t n = dev.info.maxCU * (prog.reqdLocalSize ? prog.reqdLocalSize : 4);
+    prep.setUnitQueue(units);
+    if (prep.setNumWorkers(n) || prep.allocState(n) || prep.buildGPUbuf() ||
+        prep.cancel() || qs.stop.finish() || prep.start({ prep.numWorkers }) ||
+        prep.wait()) {
+      fprintf(stderr, "testCancel: batch failed\n");
+      return 1;
+    }
+    // The work count drops back to 0 only if every pair was not done.
+    if (!prep.undone || prep.getWorkCount() || !prep.matches.empty()) {
+      fprintf(stderr, "testCancel: %lld pairs not done, %lld done, %zu "
+              "matches (units=%d)\n", prep.undone, prep.getWorkCount(),
+              prep.matches.size(), units);
+      return 1;
+    }
+
+    prep.markAllCtimeDone();
+    auto t0 = Clock::now();
+    if (prep.setBatch(count, n) || prep.buildGPUbuf() ||
+        prep.start({ prep.numWorkers }) || prep.cancel() || prep.wait()) {
+      fprintf(stderr, "testCancel: batch failed\n");
+      return 1;
+    }
+    std::chrono::duration<float> sec = Clock::now() - t0;
+    long long done = prep.getWorkSincePrev();
+    if (prep.undone <= 0 || done < 0 ||
+        done + prep.undone != prep.getHashes()) {
+      fprintf(stderr, "testCancel: %lld pairs not done, %lld done, of %lld "
+              "in %.1fs (units=%d)\n", prep.undone, done, prep.getHashes(),
+              sec.count(), units);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// KernelVariant is one way to build sha1.cl: see the -D options listed at
+// the top of sha1.cl.
+struct KernelVariant {
+  const char* name;
+  const char* defines;
+};
+
+static const KernelVariant kernelVariants[] = {
+  { "vector", "" },
+  { "scalar", " -DB2_SCALAR_G" },
+  { "emu32", " -DB2_SCALAR_G -DB2_EMU32" },
+  { "plainf", " -DSHA1_PLAIN_F" },
+  { "wg64", " -DREQD_WG=64" },
+  { "lanes2", " -DLANES=2" },
+  { "lanes4", " -DLANES=4" },
+  { "lanes8", " -DLANES=8" },
+};
+
+int benchKernel(OpenCLdev& dev, OpenCLprog& prog,
+                const CommitMessage& commit, float& rate) {
+  PipeQueues qs(dev);
+  if (qs.open()) {
+    return 1;
+  }
+  CPUprep prep(dev, prog, qs, commit, commit.atime(), commit.ctime());
+  TuneConfig c;
+  c.numWorkers = dev.info.maxCU*dev.info.maxWG;
+  c.localSize = prog.reqdLocalSize;
+  if (c.localSize) {
+    c.numWorkers = (c.numWorkers + c.localSize - 1) / c.localSize *
+                   c.localSize;
+  }
+  if (prep.allocState(c.numWorkers)) {
+    return 1;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (i) {
+      prep.markAllCtimeDone();
+    }
+    if (prep.setTune(c) || prep.buildGPUbuf() ||
+        prep.start({ prep.numWorkers }) || prep.wait()) {
+      fprintf(stderr, "benchKernel: batch %d failed\n", i);
+      return 1;
+    }
+  }
+  rate = prep.getWorkRate();
+  return 0;
+}
+
+// buildVariant builds variant v of code in p, if it can run on dev.
+static int buildVariant(OpenCLdev& dev, const char* code,
+                        const std::string& buildargs, const KernelVariant& v,
+                        std::unique_ptr<OpenCLprog>& p) {
+  p.reset(new OpenCLprog(code, dev));
+  p->variant = v.name;
+  if (p->open("main", buildargs + v.defines)) {
+    fprintf(stderr, "variant %s: build failed\n", v.name);
+    return 1;
+  }
+  if (p->reqdLocalSize > dev.info.maxWG) {
+    fprintf(stderr, "variant %s: needs work-groups of %zu, max is %zu\n",
+            v.name, p->reqdLocalSize, dev.info.maxWG);
+    return 1;
+  }
+  return 0;
+}
+
+int openKernel(OpenCLdev& dev, const char* code, const CommitMessage& commit,
+               const std::string& buildargs,
+               std::unique_ptr<OpenCLprog>& prog) {
+  auto build = [&](const KernelVariant& v, std::unique_ptr<OpenCLprog>& p) {
+    return buildVariant(dev, code, buildargs, v, p);
+  };
+
+  std::string saved;
+  if (!loadVariant(dev, code, saved)) {
+    for (const auto& v : kernelVariants) {
+      if (saved == v.name && !build(v, prog)) {
+        fprintf(stderr, "variant %s from cache\n", v.name);
+        return 0;
+      }
+    }
+    fprintf(stderr, "variant %s from cache is not available\n",
+            saved.c_str());
+  }
+
+  // Benchmark every variant that builds and gets the right hash.
+  prog.reset();
+  float bestRate = 0;
+  for (const auto& v : kernelVariants) {
+    std::unique_ptr<OpenCLprog> p;
+    float rate;
+    if (build(v, p) || testGPUsha1(dev, *p, commit) ||
+        benchKernel(dev, *p, commit, rate)) {
+      fprintf(stderr, "variant %s: skipped\n", v.name);
+      continue;
+    }
+    fprintf(stderr, "variant %s: %.3fM/s\n", v.name, rate * 1e-6);
+    if (!prog || rate > bestRate) {
+      prog = std::move(p);
+      bestRate = rate;
+    }
+  }
+  if (!prog) {
+    fprintf(stderr, "openKernel: no variant works on this device\n");
+    return 1;
+  }
+  fprintf(stderr, "variant %s is fastest\n", prog->variant.c_str());
+  (void)saveVariant(dev, code, prog->variant, bestRate);
+  return 0;
+}
+
+// SELFTEST_PAIRS is the most pairs in one selfTestKernel batch. Every match
+// is reported, and about a fifth of all pairs match, so that many matches
+// must fit in MATCH_RING.
+#define SELFTEST_PAIRS (160)
+// SELFTEST_SHAPED is how many cases also get a kernel built for their own
+// layout, like findHash builds.
+#define SELFTEST_SHAPED (2)
+
+// SelfTestCase is one randomized batch for selfTestKernel.
+struct SelfTestCase {
+  CommitMessage commit;  // Has the batch's first atime and ctime.
+  long long count;  // ctimes in the batch.
+  size_t workers;
+  bool units;
+  uint32_t minMatchLen;
+};
+
+static long long pow10ll(int n) {
+  long long p = 1;
+  while (n-- > 0) {
+    p *= 10;
+  }
+  return p;
+}
+
+// randomCase outputs a commit with random names, parents and message, so
+// the digits land at every offset in a word, and a batch of it. The times
+// all have the same number of digits, and often end in 9s, so the batch
+// carries into more digits of them.
+static int randomCase(std::mt19937_64& rng, size_t reqdLocalSize,
+                      SelfTestCase& tc) {
+  auto randStr = [&](size_t n, const char* chars) {
+    std::string out;
+    size_t k = strlen(chars);
+    for (size_t i = 0; i < n; i++) {
+      out.push_back(chars[rng() % k]);
+    }
+    return out;
+  };
+  static const char hex[] = "0123456789abcdef";
+  static const char name[] = "abcdefghijklmnopqrstuvwxyz ABCXYZ.-";
+  static const char text[] = "abcdefghijklmnopqrstuvwxyz0123456789 ,.:\n";
+
+  int width = 1 + rng() % 12;
+  long long lo = width > 1 ? pow10ll(width - 1) : 0;
+  long long hi = pow10ll(width) - 1;
+  long long ctime = lo + (long long)(rng() % (hi - lo + 1));
+  int nines = rng() % (width + 1);
+  if (nines) {
+    ctime += pow10ll(nines) - 1 - ctime % pow10ll(nines) -
+             (long long)(rng() % 4);
+  }
+  ctime = std::min(std::max(ctime, lo), hi);
+  long long atime = std::max(lo, ctime - (long long)(rng() % 64));
+
+  // Take as many ctimes as fit in SELFTEST_PAIRS, or fewer, keeping the
+  // last ctime (which is also the last atime) to width digits.
+  long long gap = ctime - atime;
+  long long maxCount = 1;
+  while (ctime + maxCount <= hi &&
+         (maxCount + 1)*(gap + 1) + (maxCount + 1)*maxCount/2 <=
+             SELFTEST_PAIRS) {
+    maxCount++;
+  }
+  tc.count = 1 + rng() % maxCount;
+  tc.workers = reqdLocalSize ? reqdLocalSize*(1 + rng() % 2)
+                             : 1 + rng() % 16;
+  tc.units = rng() % 2;
+  tc.minMatchLen = (rng() % 4) ? 0 : 1;
+
+  std::string body = "tree " + randStr(40, hex) + "\n";
+  for (int i = rng() % 3; i > 0; i--) {
+    body += "parent " + randStr(40, hex) + "\n";
+  }
+  body += "author " + randStr(1 + rng() % 40, name) + " <" +
+          randStr(1 + rng() % 30, name) + "> " + std::to_string(atime) +
+          " +0000\n";
+  body += "committer " + randStr(1 + rng() % 40, name) + " <" +
+          randStr(1 + rng() % 30, name) + "> " + std::to_string(ctime) +
+          " -0730\n";
+  body += "\n" + randStr(rng() % 400, text) + "\n";
+  std::string raw = "commit " + std::to_string(body.size());
+  raw.push_back(0);
+  raw += body;
+  std::vector<char> buf(raw.begin(), raw.end());
+  buf.push_back(0);
+  return tc.commit.set(buf.data(), raw.size());
+}
+
+// expectMatchLen is what compareB2SHA finds for sha and b2h: the longest run
+// of the first bytes of sha in b2h. Unlike Blake2Hash::instr, runs starting
+// in the last 4 bytes of b2h are not counted.
+static unsigned expectMatchLen(const Sha1Hash& sha, const Blake2Hash& b2h) {
+  unsigned best = 0;
+  for (size_t j = 0; j + 4 < sizeof(b2h.result); j++) {
+    unsigned i = 0;
+    while (i < sizeof(sha.result) && j + i < sizeof(b2h.result) &&
+           b2h.result[j + i] == sha.result[i]) {
+      i++;
+    }
+    best = std::max(best, i);
+  }
+  return best;
+}
+
+// runSelfTestCase runs tc with prog and checks that the kernel reports
+// exactly the matches the CPU finds. skipped is set if there are too many
+// for MATCH_RING.
+static int runSelfTestCase(OpenCLdev& dev, OpenCLprog& prog, PipeQueues& qs,
+                           const SelfTestCase& tc, bool& skipped) {
+  const CommitMessage& commit = tc.commit;
+  CPUprep prep(dev, prog, qs, commit, commit.atime(), commit.ctime());
+  prep.setUnitQueue(tc.units);
+  prep.minMatchLen = tc.minMatchLen;
+  if (prep.setBatch(tc.count, tc.workers) || prep.allocState(tc.workers) ||
+      prep.buildGPUbuf() || prep.start({ prep.numWorkers }) || prep.wait()) {
+    fprintf(stderr, "selfTest: batch failed\n");
+    return 1;
+  }
+
+  std::map<std::pair<long long, long long>, unsigned> want, got;
+  for (long long i = 0; i < prep.getHashes(); i++) {
+    long long atime, ctime;
+    prep.getPair(i, atime, ctime);
+    CommitMessage noodle(commit);
+    noodle.set_atime(atime);
+    noodle.set_ctime(ctime);
+    Sha1Hash sha;
+    Blake2Hash b2h;
+    if (noodle.hash(sha, b2h)) {
+      return 1;
+    }
+    unsigned len = expectMatchLen(sha, b2h);
+    if (len > tc.minMatchLen) {
+      want[{ atime, ctime }] = len;
+    }
+  }
+  skipped = want.size() > MATCH_RING;
+  if (skipped) {
+    return 0;
+  }
+  for (const auto& m : prep.matches) {
+    CommitMessage noodle(commit);
+    prep.updateNoodleWithMatch(m, noodle);
+    if (!got.insert({ { noodle.atime(), noodle.ctime() }, m.len }).second) {
+      fprintf(stderr, "selfTest: (%lld, %lld) reported twice\n",
+              noodle.atime(), noodle.ctime());
+      return 1;
+    }
+  }
+  if (got == want && prep.getWorkCount() == prep.getHashes()) {
+    return 0;
+  }
+  fprintf(stderr, "selfTest: atime=%lld ctime=%lld count=%lld x%zu units=%d "
+          "min=%u len=%zu: %zu matches, want %zu\n", commit.atime(),
+          commit.ctime(), tc.count, tc.workers, tc.units, tc.minMatchLen,
+          commit.header.size() + commit.toRawString().size(), got.size(),
+          want.size());
+  int shown = 0;
+  for (const auto& w : want) {
+    auto g = got.find(w.first);
+    if (g == got.end() || g->second != w.second) {
+      if (shown++ < 4) {
+        fprintf(stderr, "  (%lld, %lld): len %u, want %u\n", w.first.first,
+                w.first.second, g == got.end() ? 0 : g->second, w.second);
+      }
+    }
+  }
+  for (const auto& g : got) {
+    if (!want.count(g.first) && shown++ < 4) {
+      fprintf(stderr, "  (%lld, %lld): len %u, want none\n", g.first.first,
+              g.first.second, g.second);
+    }
+  }
+  return 1;
+}
+
+int selfTestKernel(OpenCLdev& dev, const char* code,
+                   const std::string& buildargs,
+                   const CommitMessage& benchCommit, int cases,
+                   unsigned long seed) {
+  if (testWorkAllocator()) {
+    printf("  allocator FAILED\n");
+    return 1;
+  }
+  PipeQueues qs(dev);
+  if (qs.open()) {
+    return 1;
+  }
+  std::string benchDefines;
+  if (getKernelDefines(benchCommit, benchDefines)) {
+    return 1;
+  }
+  int failed = 0;
+  for (const auto& v : kernelVariants) {
+    // Without the layout defines, one build runs every case.
+    std::unique_ptr<OpenCLprog> prog;
+    if (buildVariant(dev, code, buildargs, v, prog)) {
+      printf("  %-8s skipped\n", v.name);
+      continue;
+    }
+    // Every variant gets the same cases.
+    std::mt19937_64 rng(seed);
+    int done = 0, skipped = 0;
+    long long pairs = 0;
+    int bad = 0;
+    for (int i = 0; i < cases && !bad; i++) {
+      SelfTestCase tc;
+      if (randomCase(rng, prog->reqdLocalSize, tc)) {
+        return 1;
+      }
+      std::vector<OpenCLprog*> progs{ prog.get() };
+      std::unique_ptr<OpenCLprog> shaped;
+      if (i < SELFTEST_SHAPED) {
+        std::string defines;
+        if (getKernelDefines(tc.commit, defines) ||
+            buildVariant(dev, code, defines + buildargs, v, shaped)) {
+          bad = 1;
+          break;
+        }
+        progs.push_back(shaped.get());
+      }
+      for (auto p : progs) {
+        bool skip;
+        if (runSelfTestCase(dev, *p, qs, tc, skip)) {
+          bad = 1;
+          break;
+        }
+        skipped += skip;
+        done += !skip;
+        if (!skip) {
+          long long c = tc.count;
+          long long gap = tc.commit.ctime() - tc.commit.atime();
+          pairs += c*(gap + 1) + c*(c - 1)/2;
+        }
+      }
+    }
+    if (bad) {
+      printf("  %-8s FAILED (seed %lu)\n", v.name, seed);
+      failed++;
+      continue;
+    }
+
+    // Time it with a kernel built for benchCommit, as findHash would.
+    std::unique_ptr<OpenCLprog> bench;
+    float rate = 0;
+    if (buildVariant(dev, code, benchDefines + buildargs, v, bench) ||
+        testGPUsha1(dev, *bench, benchCommit) ||
+        benchKernel(dev, *bench, benchCommit, rate) ||
+        testCancel(dev, *bench, benchCommit, rate)) {
+      printf("  %-8s FAILED benchmark\n", v.name);
+      failed++;
+      continue;
+    }
+    printf("  %-8s ok: %d batches, %lld pairs (%d skipped), %.3fM/s\n",
+           v.name, done, pairs, skipped, rate * 1e-6);
+  }
+  return failed ? 1 : 0;
+}
+
+// MatchChecker re-checks GPU matches on the CPU in its own thread, so the
+// loop feeding the GPU does not stop to hash and commit them.
+class MatchChecker {
+public:
+  MatchChecker(LeaseSource* leases)
+      : leases(leases), stopping(false), good(0)
+      , th(&MatchChecker::worker, this) {}
+
+  ~MatchChecker() {
+    finish();
+  }
+
+  // add queues a match of len bytes that worker found in noodle.
+  void add(const CommitMessage& noodle, unsigned worker, unsigned len) {
+    std::unique_lock<std::mutex> lock(mutex);
+    todo.push_back(Match{noodle, worker, len});
+    cond.notify_all();
+  }
+
+  // found returns true once a match is printed, or leases says to stop.
+  bool found() const { return good != 0; }
+
+  // finish checks any matches already added, then stops the thread.
+  void finish() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stopping = true;
+      cond.notify_all();
+    }
+    if (th.joinable()) {
+      th.join();
+    }
+  }
+
+private:
+  struct Match {
+    CommitMessage noodle;
+    unsigned worker;
+    unsigned len;
+  };
+
+  void worker() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (todo.empty()) {
+        if (stopping) {
+          return;
+        }
+        cond.wait(lock);
+        continue;
+      }
+      Match m = todo.front();
+      todo.pop_front();
+      lock.unlock();
+      check(m);
+      lock.lock();
+    }
+  }
+
+  void check(Match& m) {
+    if (good) {
+      return;  // Only the first match is printed.
+    }
+    if (leases) {
+      if (leases->reportMatch(m.noodle.atime(), m.noodle.ctime(), m.len)) {
+        good++;
+      }
+      return;
+    }
+    // Reproduce the results on the CPU. Dump the results.
+    Sha1Hash shaout;
+    Blake2Hash b2h;
+    m.noodle.hash(shaout, b2h);
+    if (0 == printGitCommit(m.worker, shaout, b2h, m.noodle)) {
+      good++;
+    }
+  }
+
+  LeaseSource* leases;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<Match> todo;
+  bool stopping;
+  std::atomic<size_t> good;
+  std::thread th;
+};
+
 int findOnGPU(OpenCLdev& dev, OpenCLprog& prog, const CommitMessage& commit,
-              long long atime_hint, long long ctime_hint) {
+              long long atime_hint, long long ctime_hint,
+              LeaseSource* leases, bool persistent, TraceWriter* trace) {
   if (testGPUsha1(dev, prog, commit)) {
     fprintf(stderr, "testGPUsha1 failed\n");
     return 1;
@@ -604,25 +1547,33 @@ int findOnGPU(OpenCLdev& dev, OpenCLprog& prog, const CommitMessage& commit,
     }
     ctime_hint = commit.ctime();
   }
-  OpenCLqueue q(dev);
-  if (q.open()) {
-    fprintf(stderr, "q.open failed\n");
+  CtimeLease lease;
+  if (leases) {
+    if (leases->next(lease)) {
+      return 0;
+    }
+    atime_hint = lease.atime_first;
+    ctime_hint = lease.ctime_first;
+  }
+  PipeQueues qs(dev);
+  if (qs.open()) {
     return 1;
   }
 
-  fprintf(stderr, "orig ctime=%lld\n", commit.ctime());
+  fprintf(stderr, "orig ctime=%lld host buffers %s\n", commit.ctime(),
+          dev.info.hostUnified ? "mapped" : "pinned");
   auto t0 = Clock::now();
 
-  size_t prep_max = 2;
+  size_t prep_max = PIPELINE_DEPTH;
   size_t prep_i = 0;
   std::vector<CPUprep> prep;
   prep.reserve(prep_max);
   std::vector<OpenCLprog> progCopies;
   progCopies.reserve(prep_max - 1);
 
-  // Set context for the ping-ponging CPUprep instances.
-  size_t numWorkers = dev.info.maxCU*dev.info.maxWG/2;
-  size_t maxWorkers = dev.info.maxCU*dev.info.maxWG*4;
+  // Set context for the CPUprep instances, used round-robin.
+  size_t maxWorkers = dev.info.maxCU*dev.info.maxWG*64;
+  GPUTuner tuner(dev, prog, maxWorkers, persistent ? "persistent" : "");
   for (size_t i = 0; i < prep_max; i++) {
     OpenCLprog* chosenProg = NULL;
     if (i == 0) {
@@ -635,87 +1586,121 @@ int findOnGPU(OpenCLdev& dev, OpenCLprog& prog, const CommitMessage& commit,
       }
       chosenProg = &progCopies.back();
     }
-    prep.emplace_back(dev, *chosenProg, q, commit, atime_hint, ctime_hint);
-    if (prep.back().setNumWorkers(numWorkers) ||
+    prep.emplace_back(dev, *chosenProg, qs, commit, atime_hint, ctime_hint);
+    if (leases) {
+      prep.back().setLease(lease);
+    }
+    if (leases && leases->matchLen()) {
+      // Report every match that could end the search.
+      prep.back().minMatchLen = leases->matchLen() - 1;
+    }
+    prep.back().setUnitQueue(persistent);
+    prep.back().trace = trace;
+    if (prep.back().setTune(tuner.next()) ||
         prep.back().allocState(maxWorkers)) {
       return 1;
     }
+    if (!tuner.tuning()) {
+      prep.back().wantValidTime = 0;  // will set validTiming() false.
+    }
   }
 
-  if (prep.at(prep_i).buildGPUbuf()) {
-    fprintf(stderr, "first buildGPUbuf failed\n");
-    return 1;
-  }
-  if (prep.at(prep_i).start({ prep.at(prep_i).state.size() })) {
-    fprintf(stderr, "first start failed\n");
-    return 1;
-  }
-
-  long long last_work = 0;
-  bool startedWorkSizing = false;
-  size_t good = 0;
-  while (!good) {
-    // Auto-tune the workCount, etc.
-    // theP now has profiling info (unless this is the very first loop).
-    auto& theP = prep.at(prep_i);
-    auto& siblingP = prep.at((prep_i + 1) % prep_max);
-    if (theP.validTiming() && siblingP.validTiming()) {
-      float work = theP.getWorkRate();
-      float prev_work = siblingP.getWorkRate();
-      float f = 1.0f;
-      if (!startedWorkSizing) {
-        // Start walking up the capacity of the GPU with a larger batch.
-        f = 2.0f;
-      } else if (work > prev_work) {
-        // Try a larger batch, and see how the GPU responds.
-        f = 2.0f;
-      } else {
-        // This size did no good. Walk back one step and stop.
-        for (size_t i = 0; i < prep.size(); i++) {
-          prep.at(i).wantValidTime = 0;  // will set validTiming() false.
-        }
-        f = 0.5;
+  // queueBatch builds and starts the batch of work after prev in p. It sets
+  // noMoreWork instead if leases has run out, or draining if the times have
+  // more digits than the kernel can handle.
+  bool noMoreWork = false;
+  bool draining = false;
+  auto queueBatch = [&](CPUprep& p, CPUprep* prev) -> int {
+    if (prev) {
+      p.copyCountersFrom(*prev);
+      p.markAllCtimeDone();
+    }
+    if (p.needLease()) {
+      if (leases->next(lease)) {
+        noMoreWork = true;
+        return 0;
       }
-      startedWorkSizing = true;
-
-      if (f != 1.0f) {
-        numWorkers = (size_t) (numWorkers * f);
-        if (0 && startedWorkSizing) {
-          fprintf(stderr, "w=%9.0f p=%9.0f (%.3f) f=%.1f x%zu for %zu\n",
-                  work, prev_work, startedWorkSizing ? work/prev_work : 100,
-                  f, numWorkers, (prep_i + 1) % prep_max);
+      p.setLease(lease);
+    }
+    if (!p.digitsFit()) {
+      // The batches in flight still finish. The rest goes back to leases.
+      fprintf(stderr, "ctime=%lld: the kernel was built for times with %zu "
+              "digits, it drains here\n", p.getC(),
+              std::to_string(commit.ctime()).size());
+      draining = true;
+      if (p.getLease().id) {
+        CtimeLease rest = p.getLease();
+        rest.ctime_first = p.getC();
+        if (leases->unfinished(rest)) {
+          return 1;
         }
-      } else if (0) {
-        fprintf(stderr, "w=%9.0f p=%9.0f (%.3f) f=%.1f\n",
-                work, prev_work, work/prev_work, f);
       }
+      return 0;
     }
-
-    // Update siblingP to do the work coming up after theP.
-    siblingP.copyCountersFrom(theP);
-    siblingP.markAllCtimeDone();
-
-    // Build the batch of work.
-    if (siblingP.setNumWorkers(numWorkers)) {
-      fprintf(stderr, "siblingP.setNumWorkers(%zu) failed\n", numWorkers);
+    if (p.setTune(tuner.next())) {
+      fprintf(stderr, "setTune(%zu) failed\n", tuner.next().numWorkers);
       return 1;
     }
-    if (siblingP.buildGPUbuf()) {
-      fprintf(stderr, "siblingP.buildGPUbuf failed\n");
+    auto buildStart = Clock::now();
+    if (p.buildGPUbuf()) {
+      fprintf(stderr, "buildGPUbuf failed\n");
       return 1;
     }
+    if (trace) {
+      trace->hostSpan("buildGPUbuf", buildStart);
+    }
+    if (p.start({ p.numWorkers })) {
+      fprintf(stderr, "start failed\n");
+      return 1;
+    }
+    return 0;
+  };
 
-    // Kick off siblingP early, so the GPU stays full
-    if (siblingP.start({ siblingP.state.size() })) {
-      fprintf(stderr, "siblingP.start failed\n");
+  // Fill all but one slot of the pipeline. Each pass of the loop below fills
+  // the free slot before it waits for the oldest batch, so the GPU always
+  // has queued work.
+  for (size_t i = 0; i + 1 < prep_max && !noMoreWork && !draining; i++) {
+    if (queueBatch(prep.at(i), i ? &prep.at(i - 1) : NULL)) {
       return 1;
     }
+  }
+
+  MatchChecker checker(leases);
+  long long last_work = 0;
+  auto last_heartbeat = Clock::now();
+  while (!noMoreWork && !checker.found()) {
+    auto& theP = prep.at(prep_i);
+    auto& newestP = prep.at((prep_i + prep_max - 2) % prep_max);
+    auto& freeP = prep.at((prep_i + prep_max - 1) % prep_max);
+
+    // Kick off freeP early, so the GPU stays full.
+    if (!draining && queueBatch(freeP, &newestP)) {
+      return 1;
+    }
+    if (noMoreWork || !theP.inFlight) {
+      break;  // While draining, theP is the first batch that never started.
+    }
 
     // Wait for GPU to finish theP (this also copies results to the CPU)
+    auto waitStart = Clock::now();
     if (theP.wait()) {
       fprintf(stderr, "theP.wait failed\n");
       return 1;
     }
+    auto scanStart = Clock::now();
+    if (trace) {
+      trace->hostSpan("wait", waitStart);
+    }
+
+    // Auto-tune the numWorkers, etc. theP now has profiling info.
+    if (theP.validTiming()) {
+      tuner.report(theP.tune, theP.getWorkRate());
+      if (!tuner.tuning()) {
+        for (size_t i = 0; i < prep.size(); i++) {
+          prep.at(i).wantValidTime = 0;  // will set validTiming() false.
+        }
+      }
+    }
 
     // Report stats
     auto t1 = Clock::now();
@@ -734,34 +1719,56 @@ int findOnGPU(OpenCLdev& dev, OpenCLprog& prog, const CommitMessage& commit,
       }
       last_work = total_work;
       fprintf(stderr, "%.1fs %6.3fM/s ct=%lld + %2lld x%zu\n",
-              sec, r, theP.getC(), theP.getCCount(), theP.state.size());
+              sec, r, theP.getC(), theP.getCCount(), theP.numWorkers);
+    }
+    for (const auto& m : theP.matches) {
+      CommitMessage noodle(commit);
+      theP.updateNoodleWithMatch(m, noodle);
+      fprintf(stderr, "%u match=%u b  atime=%lld  ctime=%lld  in %.0fMHash\n",
+              m.worker, m.len, noodle.atime(), noodle.ctime(),
+              total_work * 1e-6);
+      checker.add(noodle, m.worker, m.len);
+    }
+    if (trace) {
+      trace->hostSpan("scan", scanStart);
     }
 
-    for (size_t i = 0; i < theP.state.size(); i++) {
-      if (theP.result.at(i).matchLen == MIN_MATCH_LEN) {
-        continue;
+    if (leases) {
+      if (theP.batchDoneWithLease() && leases->done(theP.getLease())) {
+        break;
       }
-
-      // Reproduce the results on the CPU. Dump the results.
-      CommitMessage noodle(commit);
-      theP.updateNoodleWithResultAt(i, noodle);
-      fprintf(stderr, "%zu match=%u b  atime=%lld  ctime=%lld  in %.0fMHash\n",
-              i, theP.result.at(i).matchLen, noodle.atime(),
-              noodle.ctime(), total_work * 1e-6);
-
-      Sha1Hash shaout;
-      Blake2Hash b2h;
-      noodle.hash(shaout, b2h);
-      if (0 == printGitCommit(i, shaout, b2h, noodle)) {
-        good++;
+      if (t1 - last_heartbeat >= std::chrono::seconds(1)) {
+        last_heartbeat = t1;
+        if (leases->heartbeat(total_work)) {
+          break;
+        }
       }
     }
 
     prep_i = (prep_i + 1) % prep_max;
   }
 
-  if (q.finish()) {
-    fprintf(stderr, "q.finish failed\n");
+  // Stop the batches still on the GPU instead of waiting for them to run
+  // out. What they did not hash is not counted, and their leases are not
+  // reported done, so the coordinator hands them out again.
+  for (auto& p : prep) {
+    if (p.inFlight && p.cancel()) {
+      return 1;
+    }
+  }
+  for (auto& p : prep) {
+    if (p.inFlight) {
+      if (p.wait()) {
+        return 1;
+      }
+      fprintf(stderr, "cancelled ct=%lld + %2lld: %lld pairs not done\n",
+              p.getC(), p.getCCount(), p.undone);
+    }
+  }
+
+  checker.finish();
+  if (qs.finish()) {
+    fprintf(stderr, "qs.finish failed\n");
     return 1;
   }
   return 0;
@@ -7,13 +7,19 @@
 
 #include "ocl-device.h"
 #include "ocl-program.h"
+#include "ocl-trace.h"
 #include "hashapi.h"
+#include "mine-lease.h"
+#include <memory>
 
 #pragma once
 
 namespace gitmine {
 
 #define B2H_DIGEST_LEN (8)
+// MIN_MATCH_LEN is the longest match the kernel does not report. The first
+// longer one is printed.
+#define MIN_MATCH_LEN (5)
 
 #ifndef SHA_DIGEST_LEN
 #define SHA_DIGEST_LEN (5)
@@ -21,7 +27,43 @@ namespace gitmine {
 #error SHA_DIGEST_LEN must be 5
 #endif
 
+// getKernelDefines outputs the -D options that specialize sha1.cl for the
+// layout of commit. A kernel built with them only works for that layout.
+int getKernelDefines(const CommitMessage& commit, std::string& defines);
+
+// openKernel builds code (the source of sha1.cl) for dev into prog, with
+// buildargs from getKernelDefines. There are several variants of the
+// kernel: the first run on a device benchmarks each one that builds and
+// passes a self-test, and saves the fastest. Later runs build only that one.
+int openKernel(OpenCLdev& dev, const char* code, const CommitMessage& commit,
+               const std::string& buildargs,
+               std::unique_ptr<OpenCLprog>& prog);
+
+// benchKernel runs two short batches of commit with prog and outputs the
+// hash rate of the second. The first can include warm-up time.
+int benchKernel(OpenCLdev& dev, OpenCLprog& prog, const CommitMessage& commit,
+                float& rate);
+
+// selfTestKernel checks that PrepWorkAllocator tiles its batches, then checks
+// every kernel variant of code on dev against the CPU.
+// Each one runs the same cases randomized from seed: commits of random
+// layouts and batches of random times, checking that every match is found.
+// A few of them are also run with a kernel built for their own layout.
+// It then prints each variant's hash rate on benchCommit. buildargs are the
+// build options other than the getKernelDefines ones.
+int selfTestKernel(OpenCLdev& dev, const char* code,
+                   const std::string& buildargs,
+                   const CommitMessage& benchCommit, int cases,
+                   unsigned long seed);
+
+// findOnGPU mines commit on dev. If leases is not NULL, work comes from
+// leases and matches are reported to it instead of being printed. If
+// persistent is true, the kernel's workers claim small units of each batch
+// from a queue instead of getting a fixed share of it. If trace is not NULL,
+// the timeline of every batch is written to it.
 int findOnGPU(OpenCLdev& dev, OpenCLprog& prog, const CommitMessage& commit,
-              long long atime_hint, long long ctime_hint);
+              long long atime_hint, long long ctime_hint,
+              LeaseSource* leases = NULL, bool persistent = false,
+              TraceWriter* trace = NULL);
 
 }  // namespace git-mine
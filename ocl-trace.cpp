@@ -0,0 +1,98 @@
+/* GPU pipeline timeline: Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ */
+
+#include "ocl-trace.h"
+#include <errno.h>
+#include <string.h>
+
+namespace gitmine {
+
+int TraceWriter::open(const char* path) {
+  if (f) {
+    fprintf(stderr, "validation: TraceWriter::open called twice\n");
+    return 1;
+  }
+  f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "fopen(%s): %d %s\n", path, errno, strerror(errno));
+    return 1;
+  }
+  t0 = Clock::now();
+  fprintf(f, "[\n");
+  meta(HOST, "host");
+  meta(UPLOAD, "upload");
+  meta(KERNEL, "kernel");
+  meta(READBACK, "readback");
+  return 0;
+}
+
+int TraceWriter::close() {
+  if (!f) {
+    return 0;
+  }
+  fprintf(f, "\n]\n");
+  int r = fclose(f);
+  f = NULL;
+  if (r) {
+    fprintf(stderr, "TraceWriter: fclose: %d %s\n", errno, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+void TraceWriter::sync(Clock::time_point host, OpenCLevent& ev) {
+  cl_ulong queued;
+  if (!f || ev.getQueuedTime(queued)) {
+    return;
+  }
+  long long hostNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      host - t0).count();
+  // Each sample can only be early, so the largest one is the closest.
+  long long off = hostNs - (long long)queued;
+  if (!synced || off > offsetNs) {
+    offsetNs = off;
+    synced = true;
+  }
+}
+
+void TraceWriter::hostSpan(const char* name, Clock::time_point start,
+                           const std::string& args) {
+  if (!f) {
+    return;
+  }
+  std::chrono::duration<double, std::micro> s = start - t0;
+  std::chrono::duration<double, std::micro> d = Clock::now() - start;
+  span(HOST, name, s.count(), d.count(), args);
+}
+
+void TraceWriter::deviceSpan(Track track, const char* name, OpenCLevent& from,
+                             OpenCLevent& to, const std::string& args) {
+  cl_ulong startT, endT;
+  if (!f || !synced || from.getStartTime(startT) || to.getEndTime(endT)) {
+    return;
+  }
+  if (endT < startT) {
+    endT = startT;
+  }
+  span(track, name, ((long long)startT + offsetNs) * 1e-3,
+       (endT - startT) * 1e-3, args);
+}
+
+void TraceWriter::span(Track track, const char* name, double startUs,
+                       double durUs, const std::string& args) {
+  fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+          "\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}", first ? "" : ",\n", name,
+          (int)track, startUs, durUs, args.c_str());
+  first = false;
+  fflush(f);
+}
+
+// meta names a track.
+void TraceWriter::meta(Track track, const char* name) {
+  fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", (int)track, name);
+  first = false;
+}
+
+}  // namespace git-mine
@@ -0,0 +1,57 @@
+/* GPU pipeline timeline: Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ */
+
+#pragma once
+
+#include "ocl-program.h"
+#include <chrono>
+#include <string>
+
+namespace gitmine {
+
+// TraceWriter writes a timeline of the GPU pipeline as a Chrome trace-event
+// JSON file, which chrome://tracing and Perfetto can open. Host work and the
+// commands of each queue are on their own tracks. Events are written as they
+// come: the closing ] is optional in this format, so a run that is killed
+// still leaves a usable file.
+class TraceWriter {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Track is a row of the timeline.
+  enum Track { HOST = 1, UPLOAD, KERNEL, READBACK };
+
+  TraceWriter() : f(NULL), first(true), offsetNs(0), synced(false) {}
+  ~TraceWriter() { (void)close(); }
+
+  int open(const char* path);
+  int close();
+
+  // sync relates the device's profiling clock to the host's. host is the
+  // time just before ev was enqueued, so it is at most ev's queued time.
+  void sync(Clock::time_point host, OpenCLevent& ev);
+
+  // hostSpan records host work from start until now. args is the inside of
+  // a JSON object, or empty.
+  void hostSpan(const char* name, Clock::time_point start,
+                const std::string& args = "");
+
+  // deviceSpan records the commands on track from the start of from to the
+  // end of to. Both must be done.
+  void deviceSpan(Track track, const char* name, OpenCLevent& from,
+                  OpenCLevent& to, const std::string& args = "");
+
+private:
+  void span(Track track, const char* name, double startUs, double durUs,
+            const std::string& args);
+  void meta(Track track, const char* name);
+
+  FILE* f;
+  bool first;  // No event has been written yet.
+  Clock::time_point t0;
+  long long offsetNs;  // Add to a device time to get ns since t0.
+  bool synced;
+};
+
+}  // namespace git-mine
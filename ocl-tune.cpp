@@ -0,0 +1,299 @@
+/* GPU pipeline auto-tuner: Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ */
+
+#include "ocl-tune.h"
+#include "hashapi.h"
+#include <unistd.h>
+
+namespace gitmine {
+
+// Batches run with each trial config. The first batch after a change is
+// thrown away, since it can include warm-up time.
+#define BATCHES_PER_TRIAL (3)
+
+// saveLine replaces key's line in the file at path with line, keeping the
+// other lines. The file is replaced all at once by a rename.
+static int saveLine(const std::string& path, const std::string& key,
+                    const char* line) {
+  std::string out;
+  FILE* f = fopen(path.c_str(), "r");
+  if (f) {
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f)) {
+      if (strncmp(buf, key.c_str(), key.size()) || buf[key.size()] != ' ') {
+        out += buf;
+      }
+    }
+    fclose(f);
+  }
+  out += line;
+
+  std::string tmp = path + ".tmp" + std::to_string(getpid());
+  f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "fopen(%s): %d %s\n", tmp.c_str(), errno, strerror(errno));
+    return 1;
+  }
+  if (fwrite(out.c_str(), 1, out.size(), f) != out.size() || fclose(f)) {
+    fprintf(stderr, "write %s: %d %s\n", tmp.c_str(), errno, strerror(errno));
+    unlink(tmp.c_str());
+    return 1;
+  }
+  if (rename(tmp.c_str(), path.c_str())) {
+    fprintf(stderr, "rename(%s): %d %s\n", path.c_str(), errno,
+            strerror(errno));
+    unlink(tmp.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+// cacheKey hashes code and the device and driver of dev, plus parts.
+static std::string cacheKey(OpenCLdev& dev, const char* code,
+                            std::vector<const std::string*> parts) {
+  Sha1Hash h;
+  parts.insert(parts.end(), {
+    &dev.info.name, &dev.info.vendor, &dev.info.openclver, &dev.info.driver,
+  });
+  h.update(code, strlen(code) + 1);
+  for (auto part : parts) {
+    h.update(part->c_str(), part->size() + 1);
+  }
+  h.flush();
+  char hex[SHA_DIGEST_LENGTH*2 + 1];
+  if (h.dump(hex, sizeof(hex))) {
+    return "";
+  }
+  return hex;
+}
+
+GPUTuner::GPUTuner(OpenCLdev& dev, const OpenCLprog& prog, size_t maxWorkers,
+                   const std::string& variant)
+    : dev(dev), maxWorkers(maxWorkers), fixedLocal(prog.reqdLocalSize)
+    , phase(WORKERS), trial(0), trialBatches(0), trialRate(0), bestRate(0) {
+  key = cacheKey(dev, prog.code, { &prog.funcName, &prog.variant, &variant });
+
+  if (!load()) {
+    fprintf(stderr, "tune: x%zu local=%zu scale=%u from cache\n",
+            cfg.numWorkers, cfg.localSize, cfg.batchScale);
+    phase = DONE;
+    return;
+  }
+  best.numWorkers = dev.info.maxCU*dev.info.maxWG/2;
+  if (best.numWorkers < 1) {
+    best.numWorkers = 1;
+  }
+  if (fixedLocal) {
+    // The kernel only runs with work-groups of fixedLocal.
+    best.localSize = fixedLocal;
+    best.numWorkers = (best.numWorkers + fixedLocal - 1) / fixedLocal *
+                      fixedLocal;
+  }
+  startPhase(WORKERS);
+}
+
+void GPUTuner::startPhase(Phase p) {
+  phase = p;
+  trials.clear();
+  trial = 0;
+  switch (phase) {
+    case WORKERS:
+      trials.push_back(best);
+      break;
+    case LOCAL:
+      for (size_t ls = 32; !fixedLocal && ls <= dev.info.maxWG; ls *= 2) {
+        if (best.numWorkers % ls == 0) {
+          trials.push_back(best);
+          trials.back().localSize = ls;
+        }
+      }
+      break;
+    case SCALE:
+      for (unsigned scale : { 8, 16, 64, 128 }) {
+        trials.push_back(best);
+        trials.back().batchScale = scale;
+      }
+      break;
+    case DONE:
+      break;
+  }
+  if (trials.empty()) {
+    if (phase == DONE) {
+      cfg = best;
+      fprintf(stderr, "tune: best x%zu local=%zu scale=%u %.3fM/s\n",
+              cfg.numWorkers, cfg.localSize, cfg.batchScale,
+              bestRate * 1e-6);
+      (void)save();
+      return;
+    }
+    startPhase(Phase(phase + 1));
+    return;
+  }
+  cfg = trials.at(0);
+  trialBatches = 0;
+  trialRate = 0;
+}
+
+void GPUTuner::nextTrial() {
+  trial++;
+  if (trial >= trials.size()) {
+    startPhase(Phase(phase + 1));
+    return;
+  }
+  cfg = trials.at(trial);
+  trialBatches = 0;
+  trialRate = 0;
+}
+
+void GPUTuner::report(const TuneConfig& c, float rate) {
+  // Batches from an earlier trial can still be in flight.
+  if (phase == DONE || !(c == cfg)) {
+    return;
+  }
+  trialBatches++;
+  if (trialBatches == 1) {
+    return;
+  }
+  trialRate += rate;
+  if (trialBatches < BATCHES_PER_TRIAL) {
+    return;
+  }
+  rate = trialRate / (BATCHES_PER_TRIAL - 1);
+  bool better = rate > bestRate;
+  if (better) {
+    best = c;
+    bestRate = rate;
+  }
+  if (phase == WORKERS) {
+    // Keep doubling numWorkers until it stops helping.
+    if (better && c.numWorkers*2 <= maxWorkers) {
+      trials.push_back(c);
+      trials.back().numWorkers = c.numWorkers*2;
+    }
+  }
+  nextTrial();
+}
+
+// load reads this key's config from tune.txt. Each line is:
+// key numWorkers localSize batchScale rate
+int GPUTuner::load() {
+  std::string dir = getCacheDir();
+  if (dir.empty() || key.empty()) {
+    return 1;
+  }
+  FILE* f = fopen((dir + "/tune.txt").c_str(), "r");
+  if (!f) {
+    return 1;
+  }
+  char line[256];
+  int r = 1;
+  while (fgets(line, sizeof(line), f)) {
+    char k[64];
+    TuneConfig c;
+    float rate;
+    if (sscanf(line, "%63s %zu %zu %u %f", k, &c.numWorkers, &c.localSize,
+               &c.batchScale, &rate) == 5 && key == k && c.numWorkers &&
+        c.numWorkers <= maxWorkers &&
+        (!c.localSize || c.numWorkers % c.localSize == 0) &&
+        (!fixedLocal || c.localSize == fixedLocal)) {
+      cfg = c;
+      bestRate = rate;
+      r = 0;
+    }
+  }
+  fclose(f);
+  return r;
+}
+
+// save replaces this key's line in tune.txt, keeping the other lines.
+int GPUTuner::save() {
+  std::string dir = getCacheDir();
+  if (dir.empty() || key.empty()) {
+    return 1;
+  }
+  char line[256];
+  snprintf(line, sizeof(line), "%s %zu %zu %u %.0f\n", key.c_str(),
+           cfg.numWorkers, cfg.localSize, cfg.batchScale, bestRate);
+  return saveLine(dir + "/tune.txt", key, line);
+}
+
+// loadVariant finds the kernel variant saved for code on dev in
+// variant.txt. Each line is: key name rate
+int loadVariant(OpenCLdev& dev, const char* code, std::string& name) {
+  std::string dir = getCacheDir();
+  std::string key = cacheKey(dev, code, {});
+  if (dir.empty() || key.empty()) {
+    return 1;
+  }
+  FILE* f = fopen((dir + "/variant.txt").c_str(), "r");
+  if (!f) {
+    return 1;
+  }
+  char line[256];
+  int r = 1;
+  while (fgets(line, sizeof(line), f)) {
+    char k[64], n[64];
+    float rate;
+    if (sscanf(line, "%63s %63s %f", k, n, &rate) == 3 && key == k) {
+      name = n;
+      r = 0;
+    }
+  }
+  fclose(f);
+  return r;
+}
+
+// saveVariant records name as the fastest kernel variant for code on dev.
+int saveVariant(OpenCLdev& dev, const char* code, const std::string& name,
+                float rate) {
+  std::string dir = getCacheDir();
+  std::string key = cacheKey(dev, code, {});
+  if (dir.empty() || key.empty()) {
+    return 1;
+  }
+  char line[256];
+  snprintf(line, sizeof(line), "%s %s %.0f\n", key.c_str(), name.c_str(),
+           rate);
+  return saveLine(dir + "/variant.txt", key, line);
+}
+
+// loadScore finds the hash rate saved for code on dev in score.txt. Each
+// line is: key rate
+int loadScore(OpenCLdev& dev, const char* code, float& rate) {
+  std::string dir = getCacheDir();
+  std::string key = cacheKey(dev, code, {});
+  if (dir.empty() || key.empty()) {
+    return 1;
+  }
+  FILE* f = fopen((dir + "/score.txt").c_str(), "r");
+  if (!f) {
+    return 1;
+  }
+  char line[256];
+  int r = 1;
+  while (fgets(line, sizeof(line), f)) {
+    char k[64];
+    float v;
+    if (sscanf(line, "%63s %f", k, &v) == 2 && key == k && v > 0) {
+      rate = v;
+      r = 0;
+    }
+  }
+  fclose(f);
+  return r;
+}
+
+// saveScore records the measured hash rate of code on dev.
+int saveScore(OpenCLdev& dev, const char* code, float rate) {
+  std::string dir = getCacheDir();
+  std::string key = cacheKey(dev, code, {});
+  if (dir.empty() || key.empty()) {
+    return 1;
+  }
+  char line[256];
+  snprintf(line, sizeof(line), "%s %.0f\n", key.c_str(), rate);
+  return saveLine(dir + "/score.txt", key, line);
+}
+
+}  // namespace git-mine
@@ -0,0 +1,91 @@
+/* GPU pipeline auto-tuner: Copyright (c) Volcano Authors 2018.
+ * Licensed under the GPLv3.
+ */
+
+#pragma once
+
+#include "ocl-device.h"
+#include "ocl-program.h"
+
+namespace gitmine {
+
+// TuneConfig is one setting of the parameters of the GPU pipeline.
+struct TuneConfig {
+  TuneConfig() : numWorkers(0), localSize(0), batchScale(32) {}
+
+  bool operator==(const TuneConfig& o) const {
+    return numWorkers == o.numWorkers && localSize == o.localSize &&
+           batchScale == o.batchScale;
+  }
+
+  size_t numWorkers;  // Work-items in each batch.
+  size_t localSize;  // Work-group size, or 0 to let OpenCL pick one.
+  unsigned batchScale;  // Scales the counts given to each work-item.
+};
+
+// GPUTuner searches for the TuneConfig with the best hash rate, one
+// parameter at a time, using profiled batches. The best config is saved per
+// device, driver, kernel and variant in $XDG_CACHE_HOME/git-mine/tune.txt.
+// A later run with the same key starts from it and does not tune again.
+// If prog was built with reqd_work_group_size, only that localSize is used.
+class GPUTuner {
+public:
+  // variant names any other setting that changes what is fastest. The
+  // kernel variant in prog.variant is always part of the key.
+  GPUTuner(OpenCLdev& dev, const OpenCLprog& prog, size_t maxWorkers,
+           const std::string& variant = "");
+
+  // next returns the config to use for the next batch.
+  const TuneConfig& next() const { return cfg; }
+
+  // tuning returns false once the best config is known.
+  bool tuning() const { return phase != DONE; }
+
+  // report records the hash rate of a batch that ran with config c.
+  void report(const TuneConfig& c, float rate);
+
+private:
+  enum Phase {
+    WORKERS,  // Double numWorkers while the rate improves.
+    LOCAL,  // Try each localSize.
+    SCALE,  // Try each batchScale.
+    DONE,
+  };
+
+  void startPhase(Phase p);
+  void nextTrial();
+  int load();
+  int save();
+
+  OpenCLdev& dev;
+  std::string key;
+  size_t maxWorkers;
+  size_t fixedLocal;  // prog.reqdLocalSize.
+  Phase phase;
+  TuneConfig cfg;
+  std::vector<TuneConfig> trials;
+  size_t trial;
+  int trialBatches;
+  float trialRate;
+  TuneConfig best;
+  float bestRate;
+};
+
+// loadVariant outputs the name of the kernel variant saved for code on dev
+// by saveVariant. It returns 1 if there is none. The choice is kept per
+// device and driver in $XDG_CACHE_HOME/git-mine/variant.txt.
+int loadVariant(OpenCLdev& dev, const char* code, std::string& name);
+
+// saveVariant records name as the fastest variant of code on dev.
+int saveVariant(OpenCLdev& dev, const char* code, const std::string& name,
+                float rate);
+
+// loadScore outputs the hash rate saved for code on dev by saveScore. It
+// returns 1 if there is none. Rates are kept per device and driver in
+// $XDG_CACHE_HOME/git-mine/score.txt.
+int loadScore(OpenCLdev& dev, const char* code, float& rate);
+
+// saveScore records rate (hashes/sec) as the measured speed of code on dev.
+int saveScore(OpenCLdev& dev, const char* code, float rate);
+
+}  // namespace git-mine
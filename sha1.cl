@@ -12,6 +12,13 @@
  * Bytes in a B2SHAbuffer past the end of the message *must* be set to 0, even
  * though the bytesRemaining and len indicate they should be ignored.
  *
+ * All workers share one copy of the message. Each worker derives its share
+ * of the batch (B2SHAconst.startAtime etc.) from get_global_id(0), then
+ * renders its first author and committer times into a private copy of the
+ * template's words (DigitWords). Those words replace the template's words
+ * as the message is read, so the search loop never writes __global memory
+ * except to append a match to the matches ring.
+ *
  * This code the resumes the SHA1_Update() process and computes SHA1_Final(),
  * outputting the final hash.
  *
@@ -21,6 +28,17 @@
  *
  * (bytesRemaining % 64) == (len % 64) must always be true, since a
  * B2SHAbuffer contains 64 bytes.
+ *
+ * The BLAKE2b digest is resumed the same way: b2mid is the chaining state
+ * after the first (len - b2Remaining) bytes, which is a multiple of 128.
+ *
+ * Kernel variants (see kernelVariants in ocl-sha1.cpp) are picked with -D:
+ *   B2_SCALAR_G   BLAKE2b G functions on scalars instead of ulong2 pairs.
+ *   B2_EMU32      64-bit rotates done with 32-bit shifts.
+ *   SHA1_PLAIN_F  SHA-1 F functions without bitselect().
+ *   REQD_WG=n     Require a work-group size of n.
+ *   LANES=n       Each worker hashes n adjacent pairs at once, one per vector
+ *                 lane (n is 2, 4 or 8). Implies B2_SCALAR_G.
  */
 
 #define UINT_64BYTES (64/sizeof(unsigned int))
@@ -31,51 +49,177 @@ typedef union {
 
 #define SHA_DIGEST_LEN (5)
 #define B2H_DIGEST_LEN (8)
+#define DIGIT_WORDS (4)
+#define MATCH_RING (64)
 typedef struct {
   unsigned long b2iv[B2H_DIGEST_LEN];
-  uint4 lastfullpadding;
-  uint4 lastfulllen;
-  uint4 zeropaddingandlen;
+  unsigned long b2mid[B2H_DIGEST_LEN];  // BLAKE2b state after the prefix.
   unsigned int shaiv[SHA_DIGEST_LEN];
   unsigned int len;  // The overall length of the message to digest.
   unsigned int bytesRemaining;  // Bytes to be digested on the GPU.
   unsigned int buffers;  // Buffers to be digested.
-} B2SHAconst;
-
-typedef struct {
-  unsigned int hash[SHA_DIGEST_LEN];
+  unsigned int b2Remaining;  // Bytes to be digested by BLAKE2b on the GPU.
+  unsigned int atimeWord;  // First word of the author time digits.
+  unsigned int ctimeWord;  // First word of the committer time digits.
+  unsigned int minMatchLen;  // Only matches longer than this are recorded.
+
+  // The batch. workShare() splits it up the same way as PrepWorkAllocator.
+  unsigned long startAtime;
+  unsigned long startCtime;
+  unsigned long hashes;  // Pairs in the whole batch.
+  unsigned int ctimeCount;
+  unsigned int shares;  // The batch is split into this many equal spans.
+  unsigned int mode;  // WORK_SPANS or WORK_UNITS.
 
   // counterPos is the position in the input of the last ASCII digit of the
   // counter to increment while searching for a match. Incrementing a number
   // stored as ASCII is done by incrementing the last digit, then carrying the
   // 1 to the next digit (repeat as many times as needed).
   unsigned int counterPos;
+  unsigned int ctimePos;  // The last digit of committer_time.
+  unsigned int pad;
+} B2SHAconst;
 
-  // counts is the number of increments done across all workers. (The workers
-  // figure out on their own who gets to do any odd work items.)
-  //
-  // When a match is found, state[idx].matchLen is set to the length of the
-  // substring that matches, and states[idx].matchCount is the remainder (how
-  // many counts were left). Otherwise both are set to 0.
-  unsigned long counts;
-  unsigned long matchCount;
-  unsigned int matchLen;
-  unsigned int matchCtimeCount;
-  unsigned int ctimePos;
-  unsigned int ctimeCount;
+#define WORK_SPANS (1)
+#define WORK_UNITS (2)
+
+// B2SHAstate is the SHA-1 of the last message a worker hashed (lane 0 of
+// its last LANES messages). If the batch was cancelled, share is the share
+// the worker stopped in and left is how many of its pairs were not hashed.
+// Otherwise share is NO_SHARE.
+typedef struct {
+  unsigned int hash[SHA_DIGEST_LEN];
+  unsigned int share;
+  unsigned long left;
 } B2SHAstate;
 
-#define rotl(a, n) rotate((a), (n)) 
-#define rotr(a, n) rotate((a), 64-(n)) 
+#define NO_SHARE (0xffffffffu)
+
+// CANCEL_POLL is how many pairs searchShare hashes between reads of *cancel.
+#define CANCEL_POLL (1024)
+
+// findHash builds this file with the commit's shape passed in as -D
+// defines, so the block loops and the padding fold to constants. Without
+// them, the same values are read from fixed at runtime.
+#ifndef MSG_LEN
+#define MSG_LEN (fixed->len)
+#define SHA_REMAINING (fixed->bytesRemaining)
+#define B2_REMAINING (fixed->b2Remaining)
+#define ATIME_WORD (fixed->atimeWord)
+#define CTIME_WORD (fixed->ctimeWord)
+#define COUNTER_POS (fixed->counterPos)
+#define CTIME_POS (fixed->ctimePos)
+#endif
+
+// DigitWords is a worker's private copy of the template's time words.
+typedef struct {
+  unsigned int a[DIGIT_WORDS];
+  unsigned int c[DIGIT_WORDS];
+} DigitWords;
+
+// lane32 and lane64 hold one word of each of the LANES messages a worker
+// hashes at once. Lanes are only reached with component selects, so the
+// vectors can stay in registers: LANE_FIRST(v) is lane 0, and LANE32_PUSH()
+// and LANE64_PUSH() move every lane of v down by one and put x in the last.
+#ifndef LANES
+#define LANES (1)
+#endif
+#if LANES == 1
+typedef unsigned int lane32;
+typedef unsigned long lane64;
+#define LANE_FIRST(v) (v)
+#define LANE32_PUSH(v, x) (x)
+#define LANE64_PUSH(v, x) (x)
+#else
+#if LANES == 2
+typedef uint2 lane32;
+typedef ulong2 lane64;
+#define LANES_AFTER_FIRST(v) (v).s1
+#elif LANES == 4
+typedef uint4 lane32;
+typedef ulong4 lane64;
+#define LANES_AFTER_FIRST(v) (v).s1, (v).s2, (v).s3
+#elif LANES == 8
+typedef uint8 lane32;
+typedef ulong8 lane64;
+#define LANES_AFTER_FIRST(v) (v).s1, (v).s2, (v).s3, (v).s4, (v).s5, (v).s6, \
+                             (v).s7
+#else
+#error LANES must be 1, 2, 4 or 8
+#endif
+#define LANE_FIRST(v) ((v).s0)
+#define LANE32_PUSH(v, x) ((lane32)(LANES_AFTER_FIRST(v), (x)))
+#define LANE64_PUSH(v, x) ((lane64)(LANES_AFTER_FIRST(v), (x)))
+#ifdef B2_EMU32
+#error B2_EMU32 does not support LANES
+#endif
+#ifndef B2_SCALAR_G
+#define B2_SCALAR_G  // The ulong2 G functions pair up words of one message.
+#endif
+#endif
+
+// LaneWords is the DigitWords of each lane.
+typedef struct {
+  lane32 a[DIGIT_WORDS];
+  lane32 c[DIGIT_WORDS];
+} LaneWords;
+
+// B2SHAmatch is one hit, appended to the matches ring. count is the value
+// of the share's loop counter (how many hashes were left) at the hit.
+typedef struct {
+  unsigned int worker;
+  unsigned int len;
+  unsigned long count;
+} B2SHAmatch;
+
+#define rotl(a, n) rotate((a), (lane32)(n))
+
+#ifdef B2_EMU32
+// rotr64 rotates a right by n using only 32-bit operations, for GPUs that
+// have no native 64-bit rotate. n is a constant, so the branches fold away.
+static inline unsigned long rotr64(unsigned long a, unsigned int n) {
+  unsigned int lo = (unsigned int)a;
+  unsigned int hi = (unsigned int)(a >> 32);
+  if (n >= 32) {
+    unsigned int t = lo;
+    lo = hi;
+    hi = t;
+    n -= 32;
+  }
+  if (n) {
+    unsigned int t = (lo >> n) | (hi << (32 - n));
+    hi = (hi >> n) | (lo << (32 - n));
+    lo = t;
+  }
+  return upsample(hi, lo);
+}
+#define rotr(a, n) rotr64((a), (n))
+#else
+#define rotr(a, n) rotate((a), (lane64)(64-(n)))
+#endif
 
 unsigned int swap(unsigned int val) {
     return (rotate(((val) & 0x00FF00FF), 24U) |
             rotate(((val) & 0xFF00FF00), 8U));
 }
 
+#if LANES == 1
+#define swapLanes swap
+#else
+static lane32 swapLanes(lane32 val) {
+  return rotate(val & 0x00FF00FFu, (lane32)(24U)) |
+         rotate(val & 0xFF00FF00u, (lane32)(8U));
+}
+#endif
+
 #define F2(x, y, z) ((x) ^ (y) ^ (z))
+#ifdef SHA1_PLAIN_F
+#define F1(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define F0(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#else
 #define F1(x, y, z) (bitselect(z, y, x))
 #define F0(x, y, z) (bitselect(x, y, (x ^ z)))
+#endif
 
 // Notice that in big-endian, this counts from 0 - 7
 #define SHA1M_A 0x67452301u
@@ -108,29 +252,29 @@ unsigned int swap(unsigned int val) {
   SHA1step(f, a, b, c, d, e, k, x); \
 }
 
-static void sha1_update(uint4 *WV, unsigned int *digest) {
-  unsigned int A = digest[0];
-  unsigned int B = digest[1];
-  unsigned int C = digest[2];
-  unsigned int D = digest[3];
-  unsigned int E = digest[4];
-
-  #define w0_t WV[0].s0
-  #define w1_t WV[0].s1
-  #define w2_t WV[0].s2
-  #define w3_t WV[0].s3
-  #define w4_t WV[1].s0
-  #define w5_t WV[1].s1
-  #define w6_t WV[1].s2
-  #define w7_t WV[1].s3
-  #define w8_t WV[2].s0
-  #define w9_t WV[2].s1
-  #define wa_t WV[2].s2
-  #define wb_t WV[2].s3
-  #define wc_t WV[3].s0
-  #define wd_t WV[3].s1
-  #define we_t WV[3].s2
-  #define wf_t WV[3].s3
+static void sha1_update(lane32 *W, lane32 *digest) {
+  lane32 A = digest[0];
+  lane32 B = digest[1];
+  lane32 C = digest[2];
+  lane32 D = digest[3];
+  lane32 E = digest[4];
+
+  #define w0_t W[0]
+  #define w1_t W[1]
+  #define w2_t W[2]
+  #define w3_t W[3]
+  #define w4_t W[4]
+  #define w5_t W[5]
+  #define w6_t W[6]
+  #define w7_t W[7]
+  #define w8_t W[8]
+  #define w9_t W[9]
+  #define wa_t W[10]
+  #define wb_t W[11]
+  #define wc_t W[12]
+  #define wd_t W[13]
+  #define we_t W[14]
+  #define wf_t W[15]
 
   // Round 1 - loop unrolled.
   unsigned int shaK = SHA1C00;
@@ -248,45 +392,74 @@ static void sha1_update(uint4 *WV, unsigned int *digest) {
 }
 
 
+// srcWord returns word k of the message: from the worker's own digits if k
+// is one of them, otherwise from the shared template.
+static inline lane32 srcWord(__constant B2SHAconst* fixed,
+                             const LaneWords* d,
+                             __global const B2SHAbuffer* src,
+                             unsigned int k) {
+  unsigned int a = k - ATIME_WORD;
+  if (a < DIGIT_WORDS) {
+    return d->a[a];
+  }
+  unsigned int c = k - CTIME_WORD;
+  if (c < DIGIT_WORDS) {
+    return d->c[c];
+  }
+  return (lane32)(src[k / UINT_64BYTES].buffer[k % UINT_64BYTES]);
+}
+
+static inline lane64 srcWord64(__constant B2SHAconst* fixed,
+                               const LaneWords* d,
+                               __global const B2SHAbuffer* src,
+                               unsigned int k) {
+  return upsample(srcWord(fixed, d, src, k + 1), srcWord(fixed, d, src, k));
+}
+
 static void sha1(__constant B2SHAconst* fixed,
-                 __global B2SHAstate* state,
+                 const LaneWords* d,
                  __global const B2SHAbuffer* src,
-                 unsigned int* hash) {
-  hash[0] = fixed->shaiv[0];  // Hash IV must be set on CPU.
-  hash[1] = fixed->shaiv[1];
-  hash[2] = fixed->shaiv[2];
-  hash[3] = fixed->shaiv[3];
-  hash[4] = fixed->shaiv[4];
-
-  union {
-    uint4 V[UINT_64BYTES/4];
-    unsigned int u[UINT_64BYTES];
-  } W;
-  for (unsigned int rem = fixed->bytesRemaining/(UINT_64BYTES*4);;) {
+                 lane32* hash) {
+  // Skip the constant prefix: its digest is already in shaiv.
+  unsigned int k = (MSG_LEN - SHA_REMAINING)/sizeof(unsigned int);
+  hash[0] = (lane32)(fixed->shaiv[0]);  // Hash IV must be set on CPU.
+  hash[1] = (lane32)(fixed->shaiv[1]);
+  hash[2] = (lane32)(fixed->shaiv[2]);
+  hash[3] = (lane32)(fixed->shaiv[3]);
+  hash[4] = (lane32)(fixed->shaiv[4]);
+
+  lane32 W[UINT_64BYTES];
+  for (unsigned int rem = (SHA_REMAINING - 1)/(UINT_64BYTES*4);;) {
     // Copy 64 bytes from src->buffer[], swapping to big-endian.
     // NOTE: src->buffer[] bytes past "bytesRemaining" *must* be provided as 0.
-    for (int j = 0; j < UINT_64BYTES; j++) {
-      W.u[j] = swap(src->buffer[j]);
+    for (int j = 0; j < UINT_64BYTES; j++, k++) {
+      W[j] = swapLanes(srcWord(fixed, d, src, k));
     }
 
     // If this will be the last loop and some of {padding,len} should be added.
-    if (rem == 0) {
-      W.V[(fixed->len & 63)/16] |= fixed->lastfullpadding;
-      W.V[3] |= fixed->lastfulllen;
+    if (rem == 0 && (MSG_LEN & 63)) {
+      W[(MSG_LEN & 63)/4] |= 0x80000000u >> (8*(MSG_LEN & 3));
+      if ((MSG_LEN & 63) < 56) {
+        W[UINT_64BYTES - 2] = (lane32)(MSG_LEN >> (32 - 3));
+        W[UINT_64BYTES - 1] = (lane32)(MSG_LEN << 3);
+      }
     }
-    src++;
-    sha1_update(W.V, hash);
+    sha1_update(W, hash);
     if (rem == 0) break;
     rem--;
   }
 
   // If an additional block is needed just to be able to fit len
-  if (fixed->zeropaddingandlen.s3) {
-    W.V[0] = 0;
-    W.V[1] = 0;
-    W.V[2] = 0;
-    W.V[3] = fixed->zeropaddingandlen;
-    sha1_update(W.V, hash);
+  if ((MSG_LEN & 63) == 0 || (MSG_LEN & 63) >= 56) {
+    for (int j = 0; j < UINT_64BYTES; j++) {
+      W[j] = (lane32)(0);
+    }
+    if ((MSG_LEN & 63) == 0) {
+      W[0] = (lane32)(0x80000000u);
+    }
+    W[UINT_64BYTES - 2] = (lane32)(MSG_LEN >> (32 - 3));
+    W[UINT_64BYTES - 1] = (lane32)(MSG_LEN << 3);
+    sha1_update(W, hash);
   }
 }
 
@@ -304,17 +477,85 @@ typedef unsigned long uint64_t;
 // 17 exabytes are seen. You must then set BLAKE2_EXABYTE_NOT_EXPECTED (2)
 typedef struct
 {
-  uint64_t m[B2_128BYTES/sizeof(uint64_t)];
-  uint64_t h[B2_OUTSIZE];
+  lane64 m[B2_128BYTES/sizeof(uint64_t)];
+  lane64 h[B2_OUTSIZE];
   uint64_t t[BLAKE2_EXABYTE_NOT_EXPECTED];
   uint64_t f[1];
 
   // Fields used only for this algorithm that compares hashes:
-  unsigned int oldCounts;
-  unsigned int oldSrc[2];
-  unsigned int shahash[SHA_DIGEST_LEN];
+  lane32 shahash[SHA_DIGEST_LEN];
 } blake2b_state;
 
+// B2_ROUNDS is the 12 rounds of blake2b_compress. Each sig word holds the
+// message word indexes for two G functions.
+#define B2_ROUNDS()                                  \
+  do {                                               \
+    ROUND(0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f); \
+    ROUND(0x0e0a0408, 0x090f0d06, 0x010c0002, 0x0b070503); \
+    ROUND(0x0b080c00, 0x05020f0d, 0x0a0e0306, 0x07010904); \
+    ROUND(0x07090301, 0x0d0c0b0e, 0x0206050a, 0x04000f08); \
+    ROUND(0x09000507, 0x02040a0f, 0x0e010b0c, 0x0608030d); \
+    ROUND(0x020c060a, 0x000b0803, 0x040d0705, 0x0f0e0109); \
+    ROUND(0x0c05010f, 0x0e0d040a, 0x00070603, 0x0902080b); \
+    ROUND(0x0d0b070e, 0x0c010309, 0x05000f04, 0x0806020a); \
+    ROUND(0x060f0e09, 0x0b030008, 0x0c020d07, 0x01040a05); \
+    ROUND(0x0a020804, 0x07060105, 0x0f0b090e, 0x030c0d00); \
+    ROUND(0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f); \
+    ROUND(0x0e0a0408, 0x090f0d06, 0x010c0002, 0x0b070503); \
+  } while (0)
+
+#ifdef B2_SCALAR_G
+#define G64(m0, m1, a, b, c, d)                    \
+  do {                                             \
+    v[a] += v[b] + S->m[m0];                       \
+    v[d] = rotr(v[d] ^ v[a], 32lu);                \
+    v[c] += v[d];                                  \
+    v[b] = rotr(v[b] ^ v[c], 24lu);                \
+    v[a] += v[b] + S->m[m1];                       \
+    v[d] = rotr(v[d] ^ v[a], 16lu);                \
+    v[c] += v[d];                                  \
+    v[b] = rotr(v[b] ^ v[c], 63lu);                \
+  } while (0)
+
+#define ROUND(sig0, sig1, sig2, sig3) \
+  do {                                \
+    G64((sig0) >> 24, ((sig0) >> 16) & 0xf, 0, 4,  8, 12); \
+    G64(((sig0) >> 8) & 0xf, (sig0) & 0xf,  1, 5,  9, 13); \
+    G64((sig1) >> 24, ((sig1) >> 16) & 0xf, 2, 6, 10, 14); \
+    G64(((sig1) >> 8) & 0xf, (sig1) & 0xf,  3, 7, 11, 15); \
+    G64((sig2) >> 24, ((sig2) >> 16) & 0xf, 0, 5, 10, 15); \
+    G64(((sig2) >> 8) & 0xf, (sig2) & 0xf,  1, 6, 11, 12); \
+    G64((sig3) >> 24, ((sig3) >> 16) & 0xf, 2, 7,  8, 13); \
+    G64(((sig3) >> 8) & 0xf, (sig3) & 0xf,  3, 4,  9, 14); \
+  } while (0)
+
+static void blake2b_compress(
+    __constant B2SHAconst* fixed,
+    blake2b_state *S) {
+
+  lane64 v[16] = {
+    S->h[0], S->h[1], S->h[2], S->h[3], S->h[4], S->h[5], S->h[6], S->h[7],
+    (lane64)(fixed->b2iv[0]), (lane64)(fixed->b2iv[1]),
+    (lane64)(fixed->b2iv[2]), (lane64)(fixed->b2iv[3]),
+    (lane64)(fixed->b2iv[4] ^ S->t[0]),
+#if BLAKE2_EXABYTE_NOT_EXPECTED > 1
+    (lane64)(fixed->b2iv[5] ^ S->t[1]),
+#else
+    (lane64)(fixed->b2iv[5]),
+#endif
+    (lane64)(fixed->b2iv[6] ^ S->f[0]),
+    (lane64)(fixed->b2iv[7]) /* ^ S->f[1] removed: no last_node */,
+  };
+
+  B2_ROUNDS();
+
+  for (unsigned i = 0; i < B2_OUTSIZE; ++i) {
+    S->h[i] ^= v[i] ^ v[i + 8];
+  }
+}
+
+#undef G64
+#else
 #define G32(s,vva,vb1,vb2,vvc,vd1,vd2) \
   do { \
     vva += (ulong2) (vb1 + S->m[s >> 24], vb2 + S->m[(s >> 8) & 0xf]); \
@@ -366,18 +607,7 @@ static void blake2b_compress(
       fixed->b2iv[7] /* ^ S->f[1] removed: no last_node */ },
   };
 
-  ROUND(0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f);
-  ROUND(0x0e0a0408, 0x090f0d06, 0x010c0002, 0x0b070503);
-  ROUND(0x0b080c00, 0x05020f0d, 0x0a0e0306, 0x07010904);
-  ROUND(0x07090301, 0x0d0c0b0e, 0x0206050a, 0x04000f08);
-  ROUND(0x09000507, 0x02040a0f, 0x0e010b0c, 0x0608030d);
-  ROUND(0x020c060a, 0x000b0803, 0x040d0705, 0x0f0e0109);
-  ROUND(0x0c05010f, 0x0e0d040a, 0x00070603, 0x0902080b);
-  ROUND(0x0d0b070e, 0x0c010309, 0x05000f04, 0x0806020a);
-  ROUND(0x060f0e09, 0x0b030008, 0x0c020d07, 0x01040a05);
-  ROUND(0x0a020804, 0x07060105, 0x0f0b090e, 0x030c0d00);
-  ROUND(0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f);
-  ROUND(0x0e0a0408, 0x090f0d06, 0x010c0002, 0x0b070503);
+  B2_ROUNDS();
 
   for (unsigned i = 0; i < B2_OUTSIZE/2; ++i) {
     ulong2 x = vv[i] ^ vv[i + 4];
@@ -389,6 +619,8 @@ static void blake2b_compress(
 #undef G32
 #undef G2v
 #undef G2vsplit
+#endif  // B2_SCALAR_G
+#undef B2_ROUNDS
 #undef ROUND
 
 static inline void blake2b_increment_counter(blake2b_state *S, uint64_t inc) {
@@ -400,161 +632,338 @@ static inline void blake2b_increment_counter(blake2b_state *S, uint64_t inc) {
 }
 
 static inline void blake2b_update(__constant B2SHAconst* fixed,
+                                  const LaneWords* d,
                                   blake2b_state* S,
                                   __global const B2SHAbuffer* src) {
-  // inline blake2b_init:
-  S->t[0] = 0;
+  // Resume from the state after the constant prefix, computed on the CPU
+  // (blake2b_init, with the parameter block already applied).
+  S->t[0] = MSG_LEN - B2_REMAINING;
 #if BLAKE2_EXABYTE_NOT_EXPECTED > 1
   S->t[1] = 0;
 #endif
   S->f[0] = 0;
 
-  for (unsigned i = 0; i < B2_OUTSIZE; i++) S->h[i] = fixed->b2iv[i];
-
-  // xor with P->fanout       = 1;
-  // xor with P->depth        = 1;
-  S->h[0] ^= 0x01010000 | sizeof(S->h);
+  for (unsigned i = 0; i < B2_OUTSIZE; i++) {
+    S->h[i] = (lane64)(fixed->b2mid[i]);
+  }
+  unsigned int k = S->t[0]/sizeof(unsigned int);
 
   // begin blake2b_update:
-  uint32_t rem = fixed->bytesRemaining;
+  uint32_t rem = B2_REMAINING;
   while (rem > B2_128BYTES) {
     for (unsigned i = 0; i < B2_128BYTES/sizeof(uint64_t); i++) {
-      S->m[i] = src->buf64[i];
+      S->m[i] = srcWord64(fixed, d, src, k + i*2);
     }
     blake2b_increment_counter(S, B2_128BYTES);
     blake2b_compress(fixed, S);
-    src += B2_128BYTES/sizeof(*src);
+    k += B2_128BYTES/sizeof(unsigned int);
     rem -= B2_128BYTES;
   }
 
   // blake2b_final:
-  for (unsigned i = 0; i < B2_128BYTES/sizeof(uint64_t); i++) S->m[i] = 0;
+  for (unsigned i = 0; i < B2_128BYTES/sizeof(uint64_t); i++) {
+    S->m[i] = (lane64)(0);
+  }
   blake2b_increment_counter(S, rem);
   unsigned int words = (rem + sizeof(uint64_t) - 1)/sizeof(uint64_t);
   for (unsigned i = 0; i < words; i++) {
-    S->m[i] = src->buf64[i];
+    S->m[i] = srcWord64(fixed, d, src, k + i*2);
   }
 
   // blake2b_set_lastblock(S) is a single line, so it is inlined as:
   S->f[0] = (uint64_t)-1;
   // Rely on any extra bytes copied from src->buffer to be 0.
   blake2b_compress(fixed, S);
-  if (words > UINT_64BYTES) {
-    src++;
-  }
 }
 
-static void asciiIncrement(__global B2SHAbuffer* src, unsigned int i) {
-  unsigned int srcIdx = i / 64;
-  i &= (64 - 1);
-  unsigned int bits = 8*(i & (sizeof(unsigned int) - 1));
-  i /= sizeof(unsigned int);
+// asciiIncrement adds 1 to the ASCII number whose last digit is byte i of
+// words, carrying the 1 into the digits to its left as needed.
+static void asciiIncrement(unsigned int* words, unsigned int i) {
   for (;;) {
-    unsigned int digit = src[srcIdx].buffer[i];
-    src[srcIdx].buffer[i] = digit +
+    unsigned int bits = 8*(i & (sizeof(unsigned int) - 1));
+    unsigned int digit = words[i / sizeof(unsigned int)];
+    words[i / sizeof(unsigned int)] = digit +
         (((((digit >> bits) & 0xff) >= 0x39) ? -9 : 1) << bits);
-    if (((digit >> bits) & 0xff) < 0x39 /*ASCII '9'*/) {
+    if (((digit >> bits) & 0xff) < 0x39 /*ASCII '9'*/ || i == 0) {
       break;
     }
-    if (bits == 0) {
-      bits = 8*sizeof(unsigned int);
-      if (i == 0) {
-        if (srcIdx == 0) {
-          break;
-        }
-        srcIdx--;
-        i = 64;
-      }
-      i--;
+    i--;
+  }
+}
+
+// renderDigits writes val in ASCII into words, ending at byte i. Like
+// writing a time into the template on the CPU, it only replaces digits, so
+// val must have as many digits as the template's time.
+static void renderDigits(unsigned int* words, unsigned int i,
+                         unsigned long val) {
+  for (;;) {
+    unsigned int bits = 8*(i & (sizeof(unsigned int) - 1));
+    unsigned int w = words[i / sizeof(unsigned int)];
+    unsigned int c = (w >> bits) & 0xff;
+    if (c < 0x30 /*ASCII '0'*/ || c > 0x39 /*ASCII '9'*/) {
+      break;
     }
-    bits -= 8;
+    words[i / sizeof(unsigned int)] = (w & ~(0xffu << bits)) |
+        ((0x30u + (unsigned int)(val % 10)) << bits);
+    val /= 10;
+    if (i == 0) {
+      break;
+    }
+    i--;
   }
 }
 
-// S->shahash has not been run through swap() yet, so it is big-endian.
-static void compareB2SHA(__global B2SHAstate* state, blake2b_state* S) {
+// rowsHashes returns how many pairs the batch's first k ctimes have. Each
+// ctime has all the atimes from startAtime up to itself.
+static unsigned long rowsHashes(__constant B2SHAconst* fixed,
+                                unsigned long k) {
+  return k*(fixed->startCtime - fixed->startAtime + 1) + k*(k - 1)/2;
+}
+
+// workShare computes share w's first atime and ctime and how many pairs it
+// has. It matches PrepWorkAllocator's shareFirst(), shareEnd() and getPair().
+static void workShare(__constant B2SHAconst* fixed, unsigned long w,
+                      unsigned long* aFirst, unsigned long* cFirst,
+                      unsigned long* counts) {
+  unsigned long first = w*fixed->hashes/fixed->shares;
+  *counts = (w + 1)*fixed->hashes/fixed->shares - first;
+
+  // Find the ctime (row) of pair number first by bisection.
+  unsigned long lo = 0, hi = fixed->ctimeCount - 1;
+  while (lo < hi) {
+    unsigned long mid = lo + (hi - lo + 1)/2;
+    if (rowsHashes(fixed, mid) <= first) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  *cFirst = fixed->startCtime + lo;
+  *aFirst = fixed->startAtime + first - rowsHashes(fixed, lo);
+}
+
+// compareB2SHA compares one lane's digests: h is its BLAKE2b digest and
+// shahash its SHA-1, which has not been run through swap() yet, so it is
+// big-endian. It returns the length of the longest match, or 0 if no match
+// can be longer than fixed->minMatchLen.
+static unsigned int compareB2SHA(__constant B2SHAconst* fixed,
+                                 const unsigned long* h,
+                                 const unsigned int* shahash) {
+  // A match longer than minMatchLen starts with the first fpLen bytes of
+  // the SHA-1. Test them at all 60 byte offsets of the BLAKE2b digest first:
+  // lane w of win has the bytes at offset 8*w + r in its low bytes, from a
+  // funnel shift of h[w] and h[w + 1].
+  unsigned int fpLen = min(fixed->minMatchLen + 1, 4u);
+  ulong mask = (1ul << (8*fpLen)) - 1;
+  ulong want = swap(shahash[0]) & mask;
+  ulong8 cur = (ulong8)(h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+  ulong8 next = (ulong8)(h[1], h[2], h[3], h[4], h[5], h[6], h[7], 0);
+  long8 hits = (long8)(0);
+  for (unsigned int r = 0; r < 8; r++) {
+    ulong8 win = cur >> (8*r);
+    if (r) {
+      win |= next << (64 - 8*r);
+    }
+    long8 hit = (win & mask) == want;
+    if (r >= 4) {
+      hit.s7 = 0;  // Offsets 60 and up are past the last one tested below.
+    }
+    hits |= hit;
+  }
+  if (!any(hits)) {
+    return 0;
+  }
+
+  // Find the exact length.
+  unsigned int matchLen = 0;
   unsigned int j;
   for (j = 0; j < B2H_DIGEST_LEN*sizeof(unsigned long) - 4; j++) {
-    unsigned long b2h = S->h[j/sizeof(unsigned long)];
+    unsigned long b2h = h[j/sizeof(unsigned long)];
     b2h >>= 8*(j & (sizeof(unsigned long) - 1));
-    if ((b2h & 0xff) != (S->shahash[0] >> 24)) {
+    if ((b2h & 0xff) != (shahash[0] >> 24)) {
       continue;
     }
     unsigned int i;
     for (i = 1; i < SHA_DIGEST_LEN*sizeof(unsigned int); i++) {
       if (j + i >= B2H_DIGEST_LEN*sizeof(unsigned long)) break;
 
-      unsigned int sha = S->shahash[i/sizeof(unsigned int)];
+      unsigned int sha = shahash[i/sizeof(unsigned int)];
       sha >>= 24 - 8*(i & (sizeof(unsigned int) - 1));
-      unsigned long b2h = S->h[(j + i)/sizeof(unsigned long)];
+      unsigned long b2h = h[(j + i)/sizeof(unsigned long)];
       b2h = (b2h >> (8*((j + i) & (sizeof(unsigned long) - 1))));
       if ((b2h & 0xff) != (sha & 0xff)) break;
     }
-    if (i > state->matchLen) {
-      state->matchCount = state->counts;
-      state->matchLen = i;
-      state->matchCtimeCount = state->ctimeCount;
+    if (i > matchLen) {
+      matchLen = i;
     }
   }
+  return matchLen;
 }
 
-static inline void getOldSrc(__global B2SHAbuffer* src,
-                             __global B2SHAstate* state,
-                             blake2b_state* S) {
-  S->oldCounts = state->counts;
-  unsigned int i = state->counterPos;
-  unsigned int srcIdx = i / 64;
-  i &= (64 - 1);
-  i /= sizeof(unsigned int);
-  S->oldSrc[0] = src[srcIdx].buffer[i];
-  if (i == 0) {
-    srcIdx--;
-    i = 64;
+// nextPair advances d from one pair to the next: the next atime, or when
+// rowLeft runs out, the next ctime starting over at oldA.
+static inline void nextPair(__constant B2SHAconst* fixed, DigitWords* d,
+                            const unsigned int* oldA, unsigned int aDigit,
+                            unsigned int cDigit, unsigned long* rowLeft,
+                            unsigned long* cFirst) {
+  if (--*rowLeft) {
+    asciiIncrement(d->a, aDigit);
+    return;
   }
-  i--;
-  S->oldSrc[1] = src[srcIdx].buffer[i];
+  // The next ctime starts over at startAtime, with one more atime.
+  for (unsigned int i = 0; i < DIGIT_WORDS; i++) {
+    d->a[i] = oldA[i];
+  }
+  asciiIncrement(d->c, cDigit);
+  ++*cFirst;
+  *rowLeft = *cFirst + 1 - fixed->startAtime;
 }
 
-static inline void restoreOldSrc(__global B2SHAbuffer* src,
-                                 __global B2SHAstate* state,
+// searchShare hashes every message in share w (see workShare). Every match
+// longer than fixed->minMatchLen is appended to matches. *matchCount counts
+// all of them, even any that did not fit in MATCH_RING. It returns how many
+// pairs were left when it saw *cancel set, or 0 if it finished.
+static unsigned long searchShare(__constant B2SHAconst* fixed,
+                                 __global const B2SHAbuffer* src,
+                                 unsigned int w,
+                                 __global unsigned int* matchCount,
+                                 __global B2SHAmatch* matches,
+                                 __global volatile const unsigned int* cancel,
                                  blake2b_state* S) {
-  unsigned int i = state->counterPos;
-  unsigned int srcIdx = i / 64;
-  i &= (64 - 1);
-  i /= sizeof(unsigned int);
-  src[srcIdx].buffer[i] = S->oldSrc[0];
-  if (i == 0) {
-    srcIdx--;
-    i = 64;
+  // Positions of the last digits, relative to atimeWords and ctimeWords.
+  unsigned int aDigit = COUNTER_POS - ATIME_WORD*sizeof(unsigned int);
+  unsigned int cDigit = CTIME_POS - CTIME_WORD*sizeof(unsigned int);
+
+  unsigned long aFirst, cFirst, counts;
+  workShare(fixed, w, &aFirst, &cFirst, &counts);
+
+  // Start from the template's words and render this share's first times.
+  // The template has startAtime, where each ctime's atimes begin: keep that
+  // in oldA.
+  DigitWords d;
+  unsigned int oldA[DIGIT_WORDS];
+  for (unsigned int i = 0; i < DIGIT_WORDS; i++) {
+    d.a[i] = src[(ATIME_WORD + i) / UINT_64BYTES].buffer[
+        (ATIME_WORD + i) % UINT_64BYTES];
+    d.c[i] = (CTIME_WORD + i < fixed->buffers*UINT_64BYTES) ?
+        src[(CTIME_WORD + i) / UINT_64BYTES].buffer[
+            (CTIME_WORD + i) % UINT_64BYTES] : 0;
+    oldA[i] = d.a[i];
+  }
+  renderDigits(d.a, aDigit, aFirst);
+  renderDigits(d.c, cDigit, cFirst);
+
+  // rowLeft counts down the atimes left for this ctime.
+  unsigned long rowLeft = cFirst + 1 - aFirst;
+  for (unsigned long n = counts; n; ) {
+    if (((counts - n) & (CANCEL_POLL - 1)) == 0 && *cancel) {
+      return n;
+    }
+    // Lane i gets the pair n - i. Lanes past the end of the share repeat
+    // its last pair, and their matches are not recorded. d never moves past
+    // the end of the share, where the digits could carry.
+    unsigned int lanes = (n < LANES) ? n : LANES;
+    LaneWords L;
+    for (unsigned int i = 0; i < LANES; i++) {
+      if (i && i < lanes) {
+        nextPair(fixed, &d, oldA, aDigit, cDigit, &rowLeft, &cFirst);
+      }
+      for (unsigned int j = 0; j < DIGIT_WORDS; j++) {
+        L.a[j] = LANE32_PUSH(L.a[j], d.a[j]);
+        L.c[j] = LANE32_PUSH(L.c[j], d.c[j]);
+      }
+    }
+    sha1(fixed, &L, src, S->shahash);
+    blake2b_update(fixed, &L, S, src);
+
+    // Shift each lane in turn down to lane 0.
+    lane64 laneH[B2H_DIGEST_LEN];
+    lane32 laneSha[SHA_DIGEST_LEN];
+    for (unsigned int j = 0; j < B2H_DIGEST_LEN; j++) {
+      laneH[j] = S->h[j];
+    }
+    for (unsigned int j = 0; j < SHA_DIGEST_LEN; j++) {
+      laneSha[j] = S->shahash[j];
+    }
+    for (unsigned int i = 0; i < lanes; i++) {
+      unsigned long h[B2H_DIGEST_LEN];
+      unsigned int shahash[SHA_DIGEST_LEN];
+      for (unsigned int j = 0; j < B2H_DIGEST_LEN; j++) {
+        h[j] = LANE_FIRST(laneH[j]);
+        laneH[j] = LANE64_PUSH(laneH[j], 0);
+      }
+      for (unsigned int j = 0; j < SHA_DIGEST_LEN; j++) {
+        shahash[j] = LANE_FIRST(laneSha[j]);
+        laneSha[j] = LANE32_PUSH(laneSha[j], 0);
+      }
+      unsigned int len = compareB2SHA(fixed, h, shahash);
+      if (len > fixed->minMatchLen) {
+        unsigned int slot = atomic_inc(matchCount);
+        if (slot < MATCH_RING) {
+          matches[slot].worker = w;
+          matches[slot].len = len;
+          matches[slot].count = n - i;
+        }
+      }
+    }
+    n -= lanes;
+    if (n) {
+      nextPair(fixed, &d, oldA, aDigit, cDigit, &rowLeft, &cFirst);
+    }
   }
-  i--;
-  src[srcIdx].buffer[i] = S->oldSrc[1];
-  state->counts = S->oldCounts;
+  return 0;
 }
 
-__kernel void main(__constant B2SHAconst* fixed,
+// main searches worker get_global_id(0)'s share of the batch. In WORK_UNITS
+// mode the workers are persistent instead: each one keeps claiming the next
+// unit from *nextUnit until all of the batch's units are claimed, so a slow
+// unit does not hold up the rest of the batch.
+//
+// The host sets *cancel to stop a batch early. Each worker then records in
+// its state what it did not finish, and units not yet claimed stay
+// unclaimed.
+#ifdef REQD_WG
+#define KERNEL_ATTRS __attribute__((reqd_work_group_size(REQD_WG, 1, 1)))
+#else
+#define KERNEL_ATTRS
+#endif
+__kernel KERNEL_ATTRS void main(__constant B2SHAconst* fixed,
                    __global B2SHAstate* states,
-                   __global B2SHAbuffer* srcs) {
+                   __global const B2SHAbuffer* src,
+                   __global unsigned int* matchCount,
+                   __global B2SHAmatch* matches,
+                   __global unsigned int* nextUnit,
+                   __global volatile const unsigned int* cancel) {
   #define idx get_global_id(0)
   #define state (&states[idx])
-  #define src (&srcs[idx*fixed->buffers])
 
   blake2b_state S;
-  getOldSrc(src, state, &S);
-  while (state->ctimeCount) {
-    while (state->counts) {
-      sha1(fixed, state, src, &S.shahash);
-      blake2b_update(fixed, &S, src);
-      compareB2SHA(state, &S);
-      state->counts--;
-
-      asciiIncrement(src, state->counterPos);
+  state->share = NO_SHARE;
+  state->left = 0;
+  if (fixed->mode == WORK_UNITS) {
+    while (!*cancel) {
+      unsigned int u = atomic_inc(nextUnit);
+      if (u >= fixed->shares) {
+        break;
+      }
+      unsigned long left = searchShare(fixed, src, u, matchCount, matches,
+                                       cancel, &S);
+      if (left) {
+        state->share = u;
+        state->left = left;
+        break;
+      }
+    }
+  } else if (idx < fixed->shares) {
+    // A work-group size from REQD_WG can leave extra workers at the end.
+    unsigned long left = searchShare(fixed, src, idx, matchCount, matches,
+                                     cancel, &S);
+    if (left) {
+      state->share = idx;
+      state->left = left;
     }
-    restoreOldSrc(src, state, &S);
-    asciiIncrement(src, state->ctimePos);
-    state->ctimeCount--;
   }
   for (unsigned int i = 0; i < SHA_DIGEST_LEN; i++) {
-    state->hash[i] = swap(S.shahash[i]);
+    state->hash[i] = swap(LANE_FIRST(S.shahash[i]));
   }
 }
@@ -0,0 +1,42 @@
+#!/bin/sh
+# test-net.sh checks distributed mining on localhost: a coordinator and two
+# workers mine a throwaway commit until one of them finds a 3-byte match,
+# which the coordinator commits.
+set -e
+top=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+port=${PORT:-$((20000 + $$ % 10000))}
+
+cd "$dir"
+git init -q
+git -c user.name=test -c user.email=test@localhost commit -q --allow-empty \
+  -m "test-net"
+old=$(git rev-parse HEAD)
+
+git cat-file commit HEAD | timeout 120 "$top/git-mine" --match-len 3 \
+  --coordinator "$port" > coordinator.log 2>&1 &
+coordinator=$!
+sleep 1
+timeout 120 "$top/git-mine" --worker "localhost:$port" > worker1.log 2>&1 &
+worker1=$!
+timeout 120 "$top/git-mine" --worker "localhost:$port" > worker2.log 2>&1 &
+worker2=$!
+
+fail=0
+for p in $coordinator $worker1 $worker2; do
+  wait $p || fail=1
+done
+joined=$(grep -c " joined$" coordinator.log || true)
+# The coordinator prints the new commit in its hint to reset to it.
+new=$(sed -n 's/^# hint: .* //p' coordinator.log)
+if [ $fail != 0 ] || [ "$joined" != 2 ] || [ -z "$new" ] ||
+   [ "$new" = "$old" ] || [ "$(git cat-file -t "$new")" != commit ]; then
+  for f in coordinator.log worker1.log worker2.log; do
+    echo "--- $f"
+    cat $f
+  done
+  echo "test-net: FAILED (exit $fail, $joined workers joined)"
+  exit 1
+fi
+echo "test-net: ok, $old -> $new"